@@ -9,25 +9,74 @@
 *
 *****************************************************************/
 
+// open_memstream(), copy_file_range()
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 // S_IRUSR, ...
 #include <sys/stat.h>
 
+// FICLONE (reflinking cached outputs)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+
 #define COL_RED		"\033[1;31m"
 #define COL_PUR		"\033[1;35m"
 #define COL_WHITE	"\033[1;37m"
 #define COL_END		"\033[0m"
 
-char const	*src_name;
-FILE		*src;
-int		line_no;
+// Part of the cache key; bump whenever the output for a given source changes
+#define ASM_VERSION	"4"
+
+// Allocations made by the current thread (for -stats)
+_Thread_local long num_allocs;
+
+void *tryMalloc(int len)
+{
+	void *ret = malloc(len);
+	if (ret == NULL) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "malloc() failed: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	num_allocs++;
+	return ret;
+}
+
+void *tryRealloc(void *ptr, int len)
+{
+	void *ret = realloc(ptr, len);
+	if (ret == NULL) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "realloc() failed: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	num_allocs++;
+	return ret;
+}
+
+int writeAll(int fd, char const *data, int len)
+{
+	int written = 0;
+	int tot_written = 0;
+	while (tot_written < len && written >= 0) {
+		tot_written += written;
+		written = write(fd, data + tot_written, len - tot_written);
+	}
+
+	return tot_written;
+}
 
 typedef struct {
 	char	*data;
@@ -35,38 +84,184 @@ typedef struct {
 	int	len;
 } Buf;
 
-void push(Buf *buf, char c)
+void reserve(Buf *buf, int cap)
 {
-	if (buf->len < buf->cap) {
-		buf->data[buf->len] = c;
-		buf->len++;
+	if (buf->cap >= cap) {
 		return;
 	}
 
-	buf->data = realloc(buf->data, 2 * buf->cap);
-	if (buf->data == NULL) {
-		fprintf(stderr, COL_RED "fatal error: " COL_END "realloc() failed: %s\n", strerror(errno));
-		exit(EXIT_FAILURE);
+	buf->data = tryRealloc(buf->data, cap);
+	buf->cap = cap;
+}
+
+// Makes room for len more bytes, growing geometrically
+void grow(Buf *buf, int len)
+{
+	if (buf->len + len <= buf->cap) {
+		return;
 	}
 
+	int cap = 2 * buf->cap;
+	if (cap < buf->len + len) {
+		cap = buf->len + len;
+	}
+
+	reserve(buf, cap);
+}
+
+void push(Buf *buf, char c)
+{
+	grow(buf, 1);
 	buf->data[buf->len] = c;
-	buf->cap *= 2;
 	buf->len++;
 }
 
-Buf line	= { .cap = 1 };
-Buf out_name	= { .cap = 1 };
-Buf out_buf	= { .cap = 1 };
-Buf lis_buf	= { .cap = 1 };
+void pushSpan(Buf *buf, char const *data, int len)
+{
+	grow(buf, len);
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+// Little endian, as expected by the emulator
+void pushWord(Buf *buf, int word)
+{
+	grow(buf, 4);
+	buf->data[buf->len] = word & 0xff;
+	buf->data[buf->len + 1] = (word >> 8) & 0xff;
+	buf->data[buf->len + 2] = (word >> 16) & 0xff;
+	buf->data[buf->len + 3] = (word >> 24) & 0xff;
+	buf->len += 4;
+}
+
+#define ARENA_BLOCK_SIZE	4096
+
+typedef struct ArenaBlock {
+	struct ArenaBlock	*next;
+	int			cap;
+	int			len;
+	char			data[];
+} ArenaBlock;
+
+// Bump allocator for per-file data (label names); reset between files
+typedef struct {
+	ArenaBlock	*head;
+} Arena;
+
+void reserveArena(Arena *arena, int len)
+{
+	if (arena->head != NULL && arena->head->cap - arena->head->len >= len) {
+		return;
+	}
+
+	int cap = ARENA_BLOCK_SIZE;
+	if (arena->head != NULL && 2 * arena->head->cap > cap) {
+		cap = 2 * arena->head->cap;
+	}
+	if (len > cap) {
+		cap = len;
+	}
+
+	ArenaBlock *blk = tryMalloc(sizeof (ArenaBlock) + cap);
+	blk->next = arena->head;
+	blk->cap = cap;
+	blk->len = 0;
+	arena->head = blk;
+}
+
+char *arenaAlloc(Arena *arena, int len)
+{
+	reserveArena(arena, len);
+
+	char *ret = arena->head->data + arena->head->len;
+	arena->head->len += len;
+	return ret;
+}
+
+// Aligned for any scalar type
+void *arenaAllocAligned(Arena *arena, int len)
+{
+	reserveArena(arena, len + 7);
+	arena->head->len = (arena->head->len + 7) & ~7;
+	return arenaAlloc(arena, len);
+}
+
+int arenaUsed(Arena const *arena)
+{
+	int used = 0;
+	for (ArenaBlock const *blk = arena->head; blk != NULL; blk = blk->next) {
+		used += blk->len;
+	}
+
+	return used;
+}
+
+// Keeps only the newest (largest) block
+void resetArena(Arena *arena)
+{
+	if (arena->head == NULL) {
+		return;
+	}
+
+	ArenaBlock *blk = arena->head->next;
+	while (blk != NULL) {
+		ArenaBlock *next = blk->next;
+		free(blk);
+		blk = next;
+	}
+
+	arena->head->next = NULL;
+	arena->head->len = 0;
+}
 
-// Only do codegen for current file if no syntax error
-bool syn_err;
+void freeArena(Arena *arena)
+{
+	resetArena(arena);
+	free(arena->head);
+	arena->head = NULL;
+}
 
 typedef struct {
 	char const	*mnem;
 	bool		op;
 } Ins;
 
+// Skip writing listing files
+bool no_lst;
+
+// Run the peephole optimizer (-O)
+bool opt;
+
+// Execution profile from 'emu -profile' for code layout (-profile)
+char const	*prof_name;
+Buf		prof_data;
+int		prof_words;
+long		*prof_count;
+
+// Record instruction/data kinds of words (needed by -O and -profile)
+bool track_kinds;
+
+// Emit relocatable objects (.ro) for simple-ld instead of executable images
+bool reloc_out;
+
+// Print per-file statistics
+bool print_stats;
+
+// Per-phase timing report (-time-report, -time-report=json)
+#define REPORT_TEXT	1
+#define REPORT_JSON	2
+int time_report;
+
+// Directory for cached outputs (NULL if caching is disabled)
+char const *cache_dir;
+
+// Explicit object file path (-o, single input only)
+char const *out_path;
+
+// Write words out in chunks while assembling, patching forward references with pwrite() (-stream)
+bool stream;
+#define STREAM_CHUNK	(1 << 16)
+
 Ins const ins[] = {
 	{
 		.mnem	= "ldc",
@@ -144,11 +339,47 @@ Ins const ins[] = {
 		.mnem	= "HALT",
 		.op	= false,
 	},
+	{
+		.mnem	= "fadd",
+		.op	= true,
+	},
+	{
+		.mnem	= "cas",
+		.op	= true,
+	},
+	{
+		.mnem	= "cid",
+		.op	= false,
+	},
 };
 #define NUM_INS		(sizeof (ins) / sizeof (Ins))
 #define BR_BEGIN_IDX	13
 #define BR_END_IDX	17
 
+// Indices into ins[] used by the optimizer
+#define INS_LDC		0
+#define INS_ADC		1
+#define INS_LDL		2
+#define INS_STL		3
+#define INS_LDNL	4
+#define INS_STNL	5
+#define INS_ADD		6
+#define INS_SUB		7
+#define INS_SHL		8
+#define INS_SHR		9
+#define INS_ADJ		10
+#define INS_A2SP	11
+#define INS_SP2A	12
+#define INS_CALL	13
+#define INS_RETURN	14
+#define INS_BRZ		15
+#define INS_BRLZ	16
+#define INS_BR		17
+#define INS_HALT	18
+#define INS_FADD	19
+#define INS_CAS		20
+#define INS_CID		21
+
 Ins const ps_ins[] = {
 	{
 		.mnem	= "data",
@@ -158,6 +389,14 @@ Ins const ps_ins[] = {
 		.mnem	= "SET",
 		.op	= true,
 	},
+	{
+		.mnem	= "export",
+		.op	= true,
+	},
+	{
+		.mnem	= "import",
+		.op	= true,
+	},
 };
 #define NUM_PS_INS	(sizeof (ps_ins) / sizeof (Ins))
 
@@ -169,6 +408,15 @@ typedef struct {
 	// out_buf word index where label is defined/used
 	int	word_idx;
 
+	// Defined by SET (value is not an address, so never relocated)
+	bool	abs;
+
+	// Use of a constant expression (name is its text), evaluated by fillLabels()
+	bool	expr;
+
+	// Use filling a whole 'data' word rather than an operand
+	bool	word;
+
 	union {
 		// Was this label definition used (for unused label warning)
 		bool	used;
@@ -192,22 +440,289 @@ void pushLabel(LabelBuf *buf, Label lab)
 		return;
 	}
 
-	buf->data = realloc(buf->data, 2 * buf->cap * sizeof (Label));
-	if (buf->data == NULL) {
-		fprintf(stderr, COL_RED "fatal error: " COL_END "realloc() failed: %s\n", strerror(errno));
-		exit(EXIT_FAILURE);
-	}
+	buf->data = tryRealloc(buf->data, 2 * buf->cap * sizeof (Label));
 
 	buf->data[buf->len] = lab;
 	buf->cap *= 2;
 	buf->len++;
 }
 
-LabelBuf defs = { .cap = 1 };
-LabelBuf uses = { .cap = 1 };
+// One line of the listing file
+typedef struct {
+	// Address column (-1 if blank, e.g. label amended by SET)
+	int	addr;
+
+	// out_buf word index shown in object code column (-1 if blank)
+	int	word_idx;
+
+	// Source text span in lis_src
+	int	src_off;
+	int	src_len;
+
+	// Change made by peephole() or layout() (NOTE_*)
+	int	note;
+} LisEnt;
+
+typedef struct {
+	LisEnt	*data;
+	int	cap;
+	int	len;
+} LisEntBuf;
+
+void pushLisEnt(LisEntBuf *buf, LisEnt ent)
+{
+	if (buf->len < buf->cap) {
+		buf->data[buf->len] = ent;
+		buf->len++;
+		return;
+	}
+
+	buf->data = tryRealloc(buf->data, 2 * buf->cap * sizeof (LisEnt));
+
+	buf->data[buf->len] = ent;
+	buf->cap *= 2;
+	buf->len++;
+}
+
+// Phases timed by -time-report
+typedef enum {
+	PHASE_READ,	// reading and stripping lines
+	PHASE_PARSE,	// parseLine()
+	PHASE_LAYOUT,
+	PHASE_PEEPHOLE,
+	PHASE_LABELS,	// fillLabels()
+	PHASE_LISTING,	// fillLisBuf()
+	PHASE_WRITE,	// writeAll() of outputs
+	NUM_PHASES,
+} Phase;
+
+char const *const phase_names[NUM_PHASES] = {
+	"read",
+	"parse",
+	"layout",
+	"peephole",
+	"labels",
+	"listing",
+	"write",
+};
+
+typedef struct {
+	double	secs;
+	long	allocs;
+} PhaseStat;
+
+typedef struct {
+	struct timespec	start;
+	long		allocs;
+} PhaseMark;
+
+// Per-file assembler state (one per worker thread with -j)
+typedef struct {
+	char const	*src_name;
+	FILE		*src;
+	int		line_no;
+
+	// Whether src is ours to close (not stdin)
+	bool		own_src;
+
+	Buf		line;
+	Buf		out_name;
+	Buf		out_buf;
+	Buf		lis_buf;
+
+	// Listing lines and their source text, recorded during parsing
+	LisEntBuf	lis;
+	Buf		lis_src;
+
+	LabelBuf	defs;
+	LabelBuf	uses;
+
+	// Symbols exported to / imported from other objects (with -r)
+	LabelBuf	exps;
+	LabelBuf	imps;
+
+	// Relocation records (word index, symbol index or -1 for local, kind) with -r
+	Buf		relocs;
+	Buf		ro_buf;
+
+	// Label names, optimizer scratch space
+	Arena		arena;
+
+	// WORD_* kind of every word in out_buf (with -O)
+	Buf		kinds;
+
+	// Whole source (for the cache key), cache entry path and warnings to store with it
+	Buf		src_data;
+	Buf		cache_path;
+	Buf		warn;
+
+	// Only do codegen for current file if no syntax error
+	bool		syn_err;
+
+	// Whether the current line has a label (for SET pseudo instruction)
+	bool		has_lab;
+
+	// Label uses pushed so far (resolved ones are dropped with -stream)
+	int		uses_pushed;
+
+	// '.rept' block being read: repeat count, line of the '.rept', and its
+	// lines (line number, length and text of each)
+	bool		in_rept;
+	int		rept_count;
+	int		rept_line;
+	Buf		rept;
+
+	// Diagnostics for the current file, printed by main() in argument order
+	FILE		*err;
+
+	// With -stream: object file, and number of words already written to it
+	int		out_fd;
+	int		flushed;
+
+	// With -time-report: time and allocations per phase, and where the JSON
+	// report goes (printed to stdout by main() in argument order)
+	PhaseStat	phases[NUM_PHASES];
+	FILE		*report;
+} Ctx;
+
+static inline PhaseMark beginPhase()
+{
+	PhaseMark mark = {0};
+	if (time_report) {
+		clock_gettime(CLOCK_MONOTONIC, &mark.start);
+		mark.allocs = num_allocs;
+	}
+
+	return mark;
+}
+
+static inline double secsSince(PhaseMark const *mark)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - mark->start.tv_sec) + (now.tv_nsec - mark->start.tv_nsec) / 1e9;
+}
+
+static inline void endPhase(Ctx *ctx, Phase phase, PhaseMark mark)
+{
+	if (time_report) {
+		ctx->phases[phase].secs += secsSince(&mark);
+		ctx->phases[phase].allocs += num_allocs - mark.allocs;
+	}
+}
+
+// Index of the next word to be emitted
+int wordIdx(Ctx const *ctx)
+{
+	return ctx->flushed + ctx->out_buf.len / 4;
+}
+
+// Overwrites the 24-bit operand of a word
+void setOp(Buf *buf, int word_idx, int op)
+{
+	buf->data[4 * word_idx + 1] = op & 0xff;
+	buf->data[4 * word_idx + 2] = (op & 0xff00) >> 8;
+	buf->data[4 * word_idx + 3] = op >> 16;
+}
+
+int getWord(Buf const *buf, int word_idx)
+{
+	return *(int *) (buf->data + 4 * word_idx);
+}
+
+int findLabel(LabelBuf const *buf, char const *name, int name_len)
+{
+	for (int i = 0; i < buf->len; i++) {
+		if (buf->data[i].name_len == name_len && memcmp(buf->data[i].name, name, name_len) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// Writes the operand (or for 'data', the whole word) of a label use, either into
+// out_buf or, with -stream, into the file if its chunk has already been written out
+void writeUse(Ctx *ctx, Label const *use, int write)
+{
+	char bytes[4] = {
+		write & 0xff,
+		(write >> 8) & 0xff,
+		(write >> 16) & 0xff,
+		(write >> 24) & 0xff,
+	};
+
+	// Operands are the upper three bytes of a word
+	int len = (use->word ? 4 : 3);
+	off_t off = 4 * (off_t) use->word_idx + 4 - len;
+
+	if (use->word_idx >= ctx->flushed) {
+		memcpy(ctx->out_buf.data + off - 4 * (off_t) ctx->flushed, bytes, len);
+		return;
+	}
+
+	if (pwrite(ctx->out_fd, bytes, len, off) != len) {
+		fprintf(ctx->err, COL_RED "fatal error: " COL_END "failed to write to output file '%s': %s\n", ctx->out_name.data, strerror(errno));
+		ctx->syn_err = true;
+	}
+}
+
+// Writes the operand of a use of the given definition (-stream)
+void patchUse(Ctx *ctx, Label const *use, Label *def)
+{
+	def->used = true;
+	writeUse(ctx, use, use->br ? def->word_idx - (use->word_idx + 1) : def->word_idx);
+}
+
+// Resolves the label use just emitted if its definition was already seen;
+// otherwise it stays in uses until the definition turns up (-stream)
+void resolveBackward(Ctx *ctx)
+{
+	Label const *use = &ctx->uses.data[ctx->uses.len - 1];
+
+	int def = findLabel(&ctx->defs, use->name, use->name_len);
+	if (def >= 0) {
+		patchUse(ctx, use, &ctx->defs.data[def]);
+		ctx->uses.len--;
+	}
+}
+
+// Resolves pending uses of the definitions made on the current line (defs from
+// first_def on), after any SET on the line has taken effect (-stream)
+void resolveForward(Ctx *ctx, int first_def)
+{
+	for (int i = first_def; i < ctx->defs.len; i++) {
+		Label *def = &ctx->defs.data[i];
+
+		int j = 0;
+		while (j < ctx->uses.len) {
+			Label const *use = &ctx->uses.data[j];
+			if (!(use->name_len == def->name_len && memcmp(use->name, def->name, use->name_len) == 0)) {
+				j++;
+				continue;
+			}
+
+			patchUse(ctx, use, def);
+			ctx->uses.data[j] = ctx->uses.data[--ctx->uses.len];
+		}
+	}
+}
+
+bool flushWords(Ctx *ctx)
+{
+	PhaseMark mark = beginPhase();
+	int written = writeAll(ctx->out_fd, ctx->out_buf.data, ctx->out_buf.len);
+	endPhase(ctx, PHASE_WRITE, mark);
+
+	if (written < ctx->out_buf.len) {
+		fprintf(ctx->err, COL_RED "fatal error: " COL_END "failed to write to output file '%s': %s\n", ctx->out_name.data, strerror(errno));
+		return false;
+	}
 
-// Whether the current line has a label (for SET pseudo instruction)
-bool has_lab;
+	ctx->flushed += ctx->out_buf.len / 4;
+	ctx->out_buf.len = 0;
+	return true;
+}
 
 bool isStrzStrnEq(char const *str, char const *strn, int n)
 {
@@ -223,28 +738,36 @@ bool isStrzStrnEq(char const *str, char const *strn, int n)
 	return (str[i] == 0 && i == n);
 }
 
-void parseSingle(char const *sym, int len)
+#define WORD_INS	0
+#define WORD_DATA	1
+
+void emitWord(Ctx *ctx, int word, char kind)
+{
+	pushWord(&ctx->out_buf, word);
+	if (track_kinds) {
+		push(&ctx->kinds, kind);
+	}
+}
+
+void parseSingle(Ctx *ctx, char const *sym, int len)
 {
 	for (int i = 0; i < NUM_INS; i++) {
 		if (isStrzStrnEq(ins[i].mnem, sym, len)) {
 			if (ins[i].op) {
 				fprintf(
-					stderr,
+					ctx->err,
 					COL_WHITE "%s:%d: " COL_RED "error: " COL_END "expected operand to instruction\n"
 					"	%.*s\n",
-					src_name,
-					line_no,
+					ctx->src_name,
+					ctx->line_no,
 					len,
 					sym
 				);
-				syn_err = true;
+				ctx->syn_err = true;
 				return;
 			}
 
-			push(&out_buf, i);
-			push(&out_buf, 0);
-			push(&out_buf, 0);
-			push(&out_buf, 0);
+			emitWord(ctx, i, WORD_INS);
 			return;
 		}
 	}
@@ -253,15 +776,15 @@ void parseSingle(char const *sym, int len)
 		if (isStrzStrnEq(ps_ins[i].mnem, sym, len)) {
 			if (ps_ins[i].op) {
 				fprintf(
-					stderr,
+					ctx->err,
 					COL_WHITE "%s:%d: " COL_RED "error: " COL_END "expected operand to pseudo instruction\n"
 					"	%.*s\n",
-					src_name,
-					line_no,
+					ctx->src_name,
+					ctx->line_no,
 					len,
 					sym
 				);
-				syn_err = true;
+				ctx->syn_err = true;
 				return;
 			}
 
@@ -273,35 +796,35 @@ void parseSingle(char const *sym, int len)
 	}
 
 	fprintf(
-		stderr,
+		ctx->err,
 		COL_WHITE "%s:%d: " COL_RED "error: " COL_END "unknown instruction\n"
 		"	%.*s\n",
-		src_name,
-		line_no,
+		ctx->src_name,
+		ctx->line_no,
 		len,
 		sym
 	);
-	syn_err = true;
+	ctx->syn_err = true;
 }
 
-int parseUpToBaseTen(int base, char const *str, int len)
+int parseUpToBaseTen(Ctx *ctx, int base, char const *str, int len)
 {
 	int num = 0;
 	int mul = 1;
 	for (int i = len - 1; i >= 0; i--) {
 		if (!(str[i] >= '0' && str[i] < '0' + base)) {
 			fprintf(
-				stderr,
+				ctx->err,
 				COL_WHITE "%s:%d: " COL_RED "error: " COL_END "expected %s literal; found:\n"
 				"	%s%.*s\n",
-				src_name,
-				line_no,
+				ctx->src_name,
+				ctx->line_no,
 				(base == 8 ? "octal" : "decimal"),
 				(base == 8 ? "0" : ""),
 				len,
 				str
 			);
-			syn_err = true;
+			ctx->syn_err = true;
 			return 0;
 		}
 
@@ -312,22 +835,22 @@ int parseUpToBaseTen(int base, char const *str, int len)
 	return num;
 }
 
-int parseHex(char const *str, int len)
+int parseHex(Ctx *ctx, char const *str, int len)
 {
 	int num = 0;
 	int mul = 1;
 	for (int i = len - 1; i >= 0; i--) {
 		if (!(str[i] >= '0' && str[i] <= '9' || str[i] >= 'A' && str[i] <= 'F' || str[i] >= 'a' && str[i] <= 'f')) {
 			fprintf(
-				stderr,
+				ctx->err,
 				COL_WHITE "%s:%d: " COL_RED "error: " COL_END "expected hexadecimal literal; found:\n"
 				"	0x%.*s\n",
-				src_name,
-				line_no,
+				ctx->src_name,
+				ctx->line_no,
 				len,
 				str
 			);
-			syn_err = true;
+			ctx->syn_err = true;
 			return 0;
 		}
 
@@ -347,7 +870,7 @@ int parseHex(char const *str, int len)
 	return num;
 }
 
-int parseNum(char const *str, int len)
+int parseNum(Ctx *ctx, char const *str, int len)
 {
 	int sign = 1;
 	if (str[0] == '+') {
@@ -362,15 +885,15 @@ int parseNum(char const *str, int len)
 	if (len == 1) {
 		if (!(str[0] >= '0' && str[0] <= '9')) {
 			fprintf(
-				stderr,
+				ctx->err,
 				COL_WHITE "%s:%d: " COL_RED "error: " COL_END "expected number literal; found:\n"
 				"	%.*s\n",
-				src_name,
-				line_no,
+				ctx->src_name,
+				ctx->line_no,
 				len,
 				str
 			);
-			syn_err = true;
+			ctx->syn_err = true;
 			return 0;
 		}
 
@@ -381,79 +904,431 @@ int parseNum(char const *str, int len)
 		if (str[1] == 'x') {
 			if (len == 2) {
 				fprintf(
-					stderr,
+					ctx->err,
 					COL_WHITE "%s:%d: " COL_RED "error: " COL_END "expected hexadecimal literal; found:\n"
 					"	0x\n",
-					src_name,
-					line_no
+					ctx->src_name,
+					ctx->line_no
 				);
-				syn_err = true;
+				ctx->syn_err = true;
 				return 0;
 			}
 
-			return sign * parseHex(str + 2, len - 2);
+			return sign * parseHex(ctx, str + 2, len - 2);
 		}
 
-		return sign * parseUpToBaseTen(8, str + 1, len - 1);
+		return sign * parseUpToBaseTen(ctx, 8, str + 1, len - 1);
 	}
 
-	return sign * parseUpToBaseTen(10, str, len);
+	return sign * parseUpToBaseTen(ctx, 10, str, len);
 }
 
-void *tryMalloc(int len)
+// Whether an operand is a plain number literal (parsed by parseNum())
+bool isLiteral(char const *str, int len)
 {
-	void *ret = malloc(len);
-	if (ret == NULL) {
-		fprintf(stderr, COL_RED "fatal error: " COL_END "malloc() failed: %s\n", strerror(errno));
-		exit(EXIT_FAILURE);
+	int i = (str[0] == '+' || str[0] == '-');
+	if (i == len || !(str[i] >= '0' && str[i] <= '9')) {
+		return false;
 	}
 
-	return ret;
+	while (i < len && (str[i] >= 'a' && str[i] <= 'z' || str[i] >= 'A' && str[i] <= 'Z' || str[i] >= '0' && str[i] <= '9')) {
+		i++;
+	}
+
+	return i == len;
 }
 
-void parseDouble(char const *sym1, int len1, char const *sym2, int len2)
+// Whether an operand is a bare label name
+bool isName(char const *str, int len)
 {
-	for (int i = 0; i < NUM_INS; i++) {
-		if (isStrzStrnEq(ins[i].mnem, sym1, len1)) {
-			if (!ins[i].op) {
-				fprintf(
-					stderr,
-					COL_WHITE "%s:%d: " COL_RED "error: " COL_END "unexpected operand to instruction\n"
-					"	%.*s %.*s\n",
-					src_name,
-					line_no,
-					len1,
-					sym1,
-					len2,
-					sym2
-				);
-				syn_err = true;
-				return;
-			}
-
-			push(&out_buf, i);
+	if (!(str[0] >= 'a' && str[0] <= 'z' || str[0] >= 'A' && str[0] <= 'Z')) {
+		return false;
+	}
 
-			if (sym2[0] == '+' || sym2[0] == '-' || (sym2[0] >= '0' && sym2[0] <= '9')) {
-				int val = parseNum(sym2, len2);
-				push(&out_buf, val & 0xff);
-				push(&out_buf, (val & 0xff00) >> 8);
-				push(&out_buf, val >> 16);
+	int i = 1;
+	while (i < len && (str[i] >= 'a' && str[i] <= 'z' || str[i] >= 'A' && str[i] <= 'Z' || str[i] >= '0' && str[i] <= '9')) {
+		i++;
+	}
+
+	return i == len;
+}
+
+#define EXPR_OK		0
+#define EXPR_LATE	1
+#define EXPR_ERR	2
+
+// Value of a (sub)expression, and how many times label addresses enter it
+// (with -r, the result may only be relocated as a single address plus a constant)
+typedef struct {
+	int	val;
+	int	addrs;
+
+	// An address was multiplied or divided
+	bool	scaled;
+} Val;
+
+// Constant expression being evaluated: + - * / over number literals and labels,
+// with parentheses. While parsing only earlier SET labels are known (anything
+// else makes it EXPR_LATE); in fillLabels() (late) every label is.
+typedef struct {
+	Ctx		*ctx;
+	char const	*str;
+	int		len;
+	int		pos;
+	bool		late;
+	int		status;
+} Expr;
+
+void exprError(Expr *expr, char const *msg, char const *name, int name_len)
+{
+	if (expr->status == EXPR_ERR) {
+		return;
+	}
+
+	fprintf(
+		expr->ctx->err,
+		COL_WHITE "%s:%d: " COL_RED "error: " COL_END "%s%.*s%s\n"
+		"	%.*s\n",
+		expr->ctx->src_name,
+		expr->ctx->line_no,
+		msg,
+		name_len,
+		name,
+		(name_len > 0 ? "'" : ""),
+		expr->len,
+		expr->str
+	);
+	expr->ctx->syn_err = true;
+	expr->status = EXPR_ERR;
+}
+
+void skipSpaces(Expr *expr)
+{
+	while (expr->pos < expr->len && (expr->str[expr->pos] == ' ' || expr->str[expr->pos] == '\t')) {
+		expr->pos++;
+	}
+}
+
+Val evalSum(Expr *expr);
+
+Val evalAtom(Expr *expr)
+{
+	Val ret = {0};
+	skipSpaces(expr);
+	if (expr->pos == expr->len) {
+		exprError(expr, "expected operand in expression", "", 0);
+		return ret;
+	}
+
+	char const *str = expr->str + expr->pos;
+	if (str[0] == '-' || str[0] == '+') {
+		expr->pos++;
+		ret = evalAtom(expr);
+		if (str[0] == '-') {
+			ret.val = -(unsigned) ret.val;
+			ret.addrs = -ret.addrs;
+		}
+		return ret;
+	}
+
+	if (str[0] == '(') {
+		expr->pos++;
+		ret = evalSum(expr);
+		skipSpaces(expr);
+		if (expr->pos == expr->len || expr->str[expr->pos] != ')') {
+			exprError(expr, "expected ')' in expression", "", 0);
+			return ret;
+		}
+		expr->pos++;
+		return ret;
+	}
+
+	int len = 0;
+	while (expr->pos + len < expr->len && (str[len] >= 'a' && str[len] <= 'z' || str[len] >= 'A' && str[len] <= 'Z' || str[len] >= '0' && str[len] <= '9')) {
+		len++;
+	}
+	expr->pos += len;
+
+	if (len == 0) {
+		exprError(expr, "expected operand in expression", "", 0);
+		return ret;
+	}
+
+	if (str[0] >= '0' && str[0] <= '9') {
+		// Bad literals are reported once, while parsing (not again by fillLabels())
+		bool syn_err = expr->ctx->syn_err;
+		expr->ctx->syn_err = false;
+		ret.val = parseNum(expr->ctx, str, len);
+		if (expr->ctx->syn_err) {
+			expr->status = EXPR_ERR;
+		}
+		expr->ctx->syn_err |= syn_err;
+		return ret;
+	}
+
+	Ctx *ctx = expr->ctx;
+	int def = findLabel(&ctx->defs, str, len);
+	if (def >= 0 && (expr->late || ctx->defs.data[def].abs)) {
+		ctx->defs.data[def].used = true;
+		ret.val = ctx->defs.data[def].word_idx;
+		ret.addrs = !ctx->defs.data[def].abs;
+	} else if (!expr->late) {
+		if (expr->status == EXPR_OK) {
+			expr->status = EXPR_LATE;
+		}
+	} else if (findLabel(&ctx->imps, str, len) >= 0) {
+		exprError(expr, "imported label used in expression: '", str, len);
+	} else {
+		exprError(expr, "undefined label in expression: '", str, len);
+	}
+
+	return ret;
+}
+
+Val evalProduct(Expr *expr)
+{
+	Val ret = evalAtom(expr);
+	while (true) {
+		skipSpaces(expr);
+		if (expr->pos == expr->len || !(expr->str[expr->pos] == '*' || expr->str[expr->pos] == '/')) {
+			return ret;
+		}
+
+		char op = expr->str[expr->pos++];
+		Val rhs = evalAtom(expr);
+		ret.scaled |= rhs.scaled || ((ret.addrs != 0 || rhs.addrs != 0) && !(op == '*' && (ret.addrs == 0 || rhs.addrs == 0)));
+		if (op == '*') {
+			ret.addrs = ret.addrs * rhs.val + rhs.addrs * ret.val;
+			ret.val = (unsigned) ret.val * rhs.val;
+		} else if (expr->status != EXPR_OK) {
+			// Values may be unknown (EXPR_LATE), so zero is no error yet
+			ret.val = 0;
+		} else if (rhs.val == 0) {
+			exprError(expr, "division by zero in expression", "", 0);
+		} else if (!(ret.val == INT32_MIN && rhs.val == -1)) {
+			ret.val /= rhs.val;
+		}
+	}
+}
+
+Val evalSum(Expr *expr)
+{
+	Val ret = evalProduct(expr);
+	while (true) {
+		skipSpaces(expr);
+		if (expr->pos == expr->len || !(expr->str[expr->pos] == '+' || expr->str[expr->pos] == '-')) {
+			return ret;
+		}
+
+		char op = expr->str[expr->pos++];
+		Val rhs = evalProduct(expr);
+		ret.scaled |= rhs.scaled;
+		if (op == '+') {
+			ret.val = (unsigned) ret.val + rhs.val;
+			ret.addrs += rhs.addrs;
+		} else {
+			ret.val = (unsigned) ret.val - rhs.val;
+			ret.addrs -= rhs.addrs;
+		}
+	}
+}
+
+// Returns EXPR_OK with *val set, EXPR_LATE if it needs labels not known yet, or
+// EXPR_ERR (reported)
+int evalExpr(Ctx *ctx, char const *str, int len, bool late, Val *val)
+{
+	Expr expr = {
+		.ctx	= ctx,
+		.str	= str,
+		.len	= len,
+		.late	= late,
+	};
+
+	*val = evalSum(&expr);
+	skipSpaces(&expr);
+	if (expr.pos < len) {
+		exprError(&expr, "unexpected character in expression: '", str + expr.pos, 1);
+	}
+
+	return expr.status;
+}
+
+// Operand that must be known while parsing ('SET', '.fill', '.rept'): literals
+// and labels set by earlier 'SET's
+bool parseConst(Ctx *ctx, char const *str, int len, int *val)
+{
+	if (len == 0) {
+		fprintf(
+			ctx->err,
+			COL_WHITE "%s:%d: " COL_RED "error: " COL_END "expected operand\n",
+			ctx->src_name,
+			ctx->line_no
+		);
+		ctx->syn_err = true;
+		return false;
+	}
+
+	if (isLiteral(str, len)) {
+		*val = parseNum(ctx, str, len);
+		return true;
+	}
+
+	Val ret;
+	int status = evalExpr(ctx, str, len, false, &ret);
+	if (status == EXPR_LATE) {
+		fprintf(
+			ctx->err,
+			COL_WHITE "%s:%d: " COL_RED "error: " COL_END "expected constant (only literals and earlier 'SET' labels)\n"
+			"	%.*s\n",
+			ctx->src_name,
+			ctx->line_no,
+			len,
+			str
+		);
+		ctx->syn_err = true;
+	}
+
+	*val = ret.val;
+	return status == EXPR_OK;
+}
+
+// Marks the labels of a dropped expression use as used
+void markExprUsed(Ctx *ctx, char const *str, int len)
+{
+	int i = 0;
+	while (i < len) {
+		int j = i;
+		while (j < len && (str[j] >= 'a' && str[j] <= 'z' || str[j] >= 'A' && str[j] <= 'Z' || str[j] >= '0' && str[j] <= '9')) {
+			j++;
+		}
+
+		int def = (j > i && !(str[i] >= '0' && str[i] <= '9') ? findLabel(&ctx->defs, str + i, j - i) : -1);
+		if (def >= 0) {
+			ctx->defs.data[def].used = true;
+		}
+
+		i = (j > i ? j : i + 1);
+	}
+}
+
+// 'export'/'import' pseudo instructions
+void parseLinkage(Ctx *ctx, LabelBuf *buf, char const *sym1, int len1, char const *sym2, int len2)
+{
+	if (!(sym2[0] >= 'a' && sym2[0] <= 'z' || sym2[0] >= 'A' && sym2[0] <= 'Z')) {
+		fprintf(
+			ctx->err,
+			COL_WHITE "%s:%d: " COL_RED "error: " COL_END "expected label operand to pseudo instruction\n"
+			"	%.*s %.*s\n",
+			ctx->src_name,
+			ctx->line_no,
+			len1,
+			sym1,
+			len2,
+			sym2
+		);
+		ctx->syn_err = true;
+		return;
+	}
+
+	if (buf == &ctx->imps && !reloc_out) {
+		fprintf(
+			ctx->err,
+			COL_WHITE "%s:%d: " COL_RED "error: " COL_END "'import' requires relocatable output (-r)\n"
+			"	%.*s %.*s\n",
+			ctx->src_name,
+			ctx->line_no,
+			len1,
+			sym1,
+			len2,
+			sym2
+		);
+		ctx->syn_err = true;
+		return;
+	}
+
+	if (findLabel(&ctx->exps, sym2, len2) >= 0 || findLabel(&ctx->imps, sym2, len2) >= 0) {
+		fprintf(
+			ctx->err,
+			COL_WHITE "%s:%d: " COL_RED "error: " COL_END "duplicate export/import\n"
+			"	%.*s %.*s\n",
+			ctx->src_name,
+			ctx->line_no,
+			len1,
+			sym1,
+			len2,
+			sym2
+		);
+		ctx->syn_err = true;
+		return;
+	}
+
+	char *name = arenaAlloc(&ctx->arena, len2);
+	memcpy(name, sym2, len2);
+	pushLabel(buf, (Label) {
+		.name = name,
+		.name_len = len2,
+		.line_no = ctx->line_no,
+	});
+}
+
+void parseDouble(Ctx *ctx, char const *sym1, int len1, char const *sym2, int len2)
+{
+	for (int i = 0; i < NUM_INS; i++) {
+		if (isStrzStrnEq(ins[i].mnem, sym1, len1)) {
+			if (!ins[i].op) {
+				fprintf(
+					ctx->err,
+					COL_WHITE "%s:%d: " COL_RED "error: " COL_END "unexpected operand to instruction\n"
+					"	%.*s %.*s\n",
+					ctx->src_name,
+					ctx->line_no,
+					len1,
+					sym1,
+					len2,
+					sym2
+				);
+				ctx->syn_err = true;
+				return;
+			}
+
+			if (isLiteral(sym2, len2)) {
+				int val = parseNum(ctx, sym2, len2);
+				emitWord(ctx, i | (unsigned) val << 8, WORD_INS);
 				return;
 			}
 
+			// Expressions over literals and earlier SET labels are folded now
+			bool expr = !isName(sym2, len2);
+			if (expr) {
+				Val val;
+				int status = evalExpr(ctx, sym2, len2, false, &val);
+				if (status == EXPR_ERR) {
+					return;
+				}
+
+				if (status == EXPR_OK) {
+					emitWord(ctx, i | (unsigned) val.val << 8, WORD_INS);
+					return;
+				}
+			}
+
 			// Filled in by fillLabels()
-			char *name = tryMalloc(len2);
+			char *name = arenaAlloc(&ctx->arena, len2);
 			memcpy(name, sym2, len2);
-			pushLabel(&uses, (Label) {
+			pushLabel(&ctx->uses, (Label) {
 				.name = name,
 				.name_len = len2,
-				.line_no = line_no,
-				.word_idx = out_buf.len / 4,
+				.line_no = ctx->line_no,
+				.word_idx = wordIdx(ctx),
+				.expr = expr,
 				.br = i >= BR_BEGIN_IDX && i <= BR_END_IDX,
 			});
-			push(&out_buf, 0);
-			push(&out_buf, 0);
-			push(&out_buf, 0);
+			ctx->uses_pushed++;
+			emitWord(ctx, i, WORD_INS);
+
+			if (stream) {
+				resolveBackward(ctx);
+			}
 			return;
 		}
 	}
@@ -462,64 +1337,77 @@ void parseDouble(char const *sym1, int len1, char const *sym2, int len2)
 		if (isStrzStrnEq(ps_ins[i].mnem, sym1, len1)) {
 			if (!ps_ins[i].op) {
 				fprintf(
-					stderr,
+					ctx->err,
 					COL_WHITE "%s:%d: " COL_RED "error: " COL_END "unexpected operand to pseudo instruction\n"
 					"	%.*s %.*s\n",
-					src_name,
-					line_no,
+					ctx->src_name,
+					ctx->line_no,
 					len1,
 					sym1,
 					len2,
 					sym2
 				);
-				syn_err = true;
+				ctx->syn_err = true;
 				return;
 			}
 
-			if (!(sym2[0] == '+' || sym2[0] == '-' || (sym2[0] >= '0' && sym2[0] <= '9'))) {
-				fprintf(
-					stderr,
-					COL_WHITE "%s:%d: " COL_RED "error: " COL_END "expected number literal operand to pseudo instruction\n"
-					"	%.*s %.*s\n",
-					src_name,
-					line_no,
-					len1,
-					sym1,
-					len2,
-					sym2
-				);
-				syn_err = true;
+			if (i == 2 || i == 3) {
+				parseLinkage(ctx, i == 2 ? &ctx->exps : &ctx->imps, sym1, len1, sym2, len2);
 				return;
 			}
 
-			int num = parseNum(sym2, len2);
+			// 'data' words may also hold label addresses, filled in by fillLabels()
+			int num = 0;
+			if (i == 0 && !isLiteral(sym2, len2)) {
+				Val val;
+				int status = evalExpr(ctx, sym2, len2, false, &val);
+				if (status == EXPR_ERR) {
+					return;
+				}
+
+				if (status == EXPR_LATE) {
+					char *name = arenaAlloc(&ctx->arena, len2);
+					memcpy(name, sym2, len2);
+					pushLabel(&ctx->uses, (Label) {
+						.name = name,
+						.name_len = len2,
+						.line_no = ctx->line_no,
+						.word_idx = wordIdx(ctx),
+						.expr = true,
+						.word = true,
+					});
+					ctx->uses_pushed++;
+				} else {
+					num = val.val;
+				}
+			} else if (!parseConst(ctx, sym2, len2, &num)) {
+				return;
+			}
 
 			switch (i) {
 				case 0:
-					push(&out_buf, num & 0xff);
-					push(&out_buf, (num & 0xff00) >> 8);
-					push(&out_buf, (num & 0xff0000) >> 16);
-					push(&out_buf, num >> 24);
+					emitWord(ctx, num, WORD_DATA);
 					return;
 
 				case 1:
-					if (!has_lab) {
+					if (!ctx->has_lab) {
 						fprintf(
-							stderr,
+							ctx->err,
 							COL_WHITE "%s:%d: " COL_RED "error: " COL_END "expected label preceeding \'SET\'\n"
 							"	%.*s %.*s\n",
-							src_name,
-							line_no,
+							ctx->src_name,
+							ctx->line_no,
 							len1,
 							sym1,
 							len2,
 							sym2
 						);
-						syn_err = true;
+						ctx->syn_err = true;
 						return;
 					}
 
-					defs.data[defs.len - 1].word_idx = num;
+					ctx->defs.data[ctx->defs.len - 1].word_idx = num;
+					ctx->defs.data[ctx->defs.len - 1].abs = true;
 					return;
 
 				default:
@@ -530,81 +1418,245 @@ void parseDouble(char const *sym1, int len1, char const *sym2, int len2)
 	}
 
 	fprintf(
-		stderr,
+		ctx->err,
 		COL_WHITE "%s:%d: " COL_RED "error: " COL_END "unknown instruction\n"
 		"	%.*s %.*s\n",
-		src_name,
-		line_no,
+		ctx->src_name,
+		ctx->line_no,
 		len1,
 		sym1,
 		len2,
 		sym2
 	);
-	syn_err = true;
+	ctx->syn_err = true;
 }
 
-void growLisBuf(char const *line, int len)
+// Records a listing line; the listing itself is formatted by fillLisBuf()
+// start is the out_buf word index before the line was parsed
+void growLisBuf(Ctx *ctx, char const *line, int len, int start)
 {
-	int start = lis_buf.len;
+	if (no_lst) {
+		return;
+	}
 
 	if (len >= 3 && memcmp(line, "SET", 3) == 0) {
 		// Amend previous line (belonging to corresponding label)
-
-		for (int i = 0; i < len + 1; i++) {
-			push(&lis_buf, 0);
+		if (ctx->lis.len == 0) {
+			return;
 		}
 
-		lis_buf.data[start - 1] = ' ';
-		memcpy(lis_buf.data + start, line, len);
-		lis_buf.data[start + len] = '\n';
+		LisEnt *prev = &ctx->lis.data[ctx->lis.len - 1];
+		prev->addr = -1;
+		prev->src_len += 1 + len;
 
-		int i = start;
-		do {
-			i--;
-		} while (i >= 0 && lis_buf.data[i] != '\n');
+		push(&ctx->lis_src, ' ');
+		pushSpan(&ctx->lis_src, line, len);
+		return;
+	}
+
+	LisEnt ent = {
+		.addr		= start,
+		.word_idx	= start,
+		.src_off	= ctx->lis_src.len,
+		.src_len	= len,
+	};
+
+	// Labels and pseudo instructions that emit nothing (e.g. 'export')
+	if (line[len - 1] == ':' || wordIdx(ctx) == start) {
+		ent.word_idx = -1;
+	}
+
+	pushSpan(&ctx->lis_src, line, len);
+	pushLisEnt(&ctx->lis, ent);
+}
+
+// Operands are 24 bits wide, so no image needs more words than this
+#define MAX_WORDS	(1 << 24)
+
+// Appends count copies of the last len bytes of buf, doubling the copied run each step
+void repeatTail(Buf *buf, int len, int count)
+{
+	int total = len * (count + 1);
+	grow(buf, total - len);
+	char *run = buf->data + buf->len - len;
+
+	int have = len;
+	while (have < total) {
+		int n = (have < total - have ? have : total - have);
+		memcpy(run + have, run, n);
+		have += n;
+	}
+
+	buf->len += total - len;
+}
 
-		memset(lis_buf.data + i + 1, ' ', 9);
+// Emits count more copies of the words from start on (still in out_buf); with
+// -stream, a chunk at a time
+void repeatWords(Ctx *ctx, int start, int count)
+{
+	int n = wordIdx(ctx) - start;
+	if (n == 0 || count == 0) {
 		return;
 	}
 
-	for (int i = 0; i < len + 19; i++) {
-		push(&lis_buf, 0);
+	// Flushing takes the run out of out_buf, so keep a copy of one to restart from
+	char *run = NULL;
+	if (stream) {
+		run = arenaAlloc(&ctx->arena, 4 * n);
+		memcpy(run, ctx->out_buf.data + ctx->out_buf.len - 4 * n, 4 * n);
+	}
+
+	while (count > 0) {
+		int k = count;
+		if (stream && k > STREAM_CHUNK / (4 * n)) {
+			k = (STREAM_CHUNK / (4 * n) > 0 ? STREAM_CHUNK / (4 * n) : 1);
+		}
+
+		repeatTail(&ctx->out_buf, 4 * n, k);
+		if (track_kinds) {
+			repeatTail(&ctx->kinds, n, k);
+		}
+		count -= k;
+
+		if (stream && count > 0) {
+			if (!flushWords(ctx)) {
+				ctx->syn_err = true;
+				return;
+			}
+
+			pushSpan(&ctx->out_buf, run, 4 * n);
+			count--;
+		}
+	}
+}
+
+// Rejects counts that would take the image past MAX_WORDS (n words per repetition)
+bool checkCount(Ctx *ctx, char const *data, int len, int count, int n)
+{
+	if (count >= 0 && (long) count * n <= MAX_WORDS - wordIdx(ctx)) {
+		return true;
+	}
+
+	fprintf(
+		ctx->err,
+		COL_WHITE "%s:%d: " COL_RED "error: " COL_END "repeat count out of range\n"
+		"	%.*s\n",
+		ctx->src_name,
+		ctx->line_no,
+		len,
+		data
+	);
+	ctx->syn_err = true;
+	return false;
+}
+
+// '.fill <count>, <value>' (count copies of a data word), '.rept <count>' (the
+// lines up to '.endr' repeated, see reptLine()) and '.endr'
+void parseDirective(Ctx *ctx, char const *data, int len)
+{
+	int i = 1;
+	while (i < len && data[i] >= 'a' && data[i] <= 'z') {
+		i++;
+	}
+
+	int j = i;
+	while (j < len && (data[j] == ' ' || data[j] == '\t')) {
+		j++;
 	}
 
-	int word_idx = out_buf.len / 4 - 1;
+	if (isStrzStrnEq(".fill", data, i) && j > i) {
+		int comma = j;
+		while (comma < len && data[comma] != ',') {
+			comma++;
+		}
+
+		int k = comma + 1;
+		while (k < len && (data[k] == ' ' || data[k] == '\t')) {
+			k++;
+		}
+
+		int count_len = comma;
+		while (count_len > j && (data[count_len - 1] == ' ' || data[count_len - 1] == '\t')) {
+			count_len--;
+		}
+
+		int count, val;
+		if (comma == len || !parseConst(ctx, data + j, count_len - j, &count) || !parseConst(ctx, data + k, len - k, &val)) {
+			if (comma == len) {
+				fprintf(
+					ctx->err,
+					COL_WHITE "%s:%d: " COL_RED "error: " COL_END "expected '.fill <count>, <value>'\n"
+					"	%.*s\n",
+					ctx->src_name,
+					ctx->line_no,
+					len,
+					data
+				);
+				ctx->syn_err = true;
+			}
+			return;
+		}
+
+		if (!checkCount(ctx, data, len, count, 1) || count == 0) {
+			return;
+		}
 
-	if (line[len - 1] == ':') {
-		word_idx++;
-		memset(lis_buf.data + start + 9, ' ', 9);
+		emitWord(ctx, val, WORD_DATA);
+		repeatWords(ctx, wordIdx(ctx) - 1, count - 1);
+		return;
 	}
 
-	sprintf(lis_buf.data + start, "%08x", word_idx);
+	if (isStrzStrnEq(".rept", data, i) && j > i) {
+		int count;
+		if (!parseConst(ctx, data + j, len - j, &count) || !checkCount(ctx, data, len, count, 0)) {
+			return;
+		}
 
-	// Need to do this separately as sprintf() and snprintf() append a terminating null byte
-	lis_buf.data[start + 8] = ' ';
+		ctx->in_rept = true;
+		ctx->rept_count = count;
+		ctx->rept_line = ctx->line_no;
+		ctx->rept.len = 0;
+		return;
+	}
 
-	memcpy(lis_buf.data + start + 18, line, len);
-	lis_buf.data[start + len + 18] = '\n';
+	fprintf(
+		ctx->err,
+		COL_WHITE "%s:%d: " COL_RED "error: " COL_END "%s\n"
+		"	%.*s\n",
+		ctx->src_name,
+		ctx->line_no,
+		(isStrzStrnEq(".endr", data, len) ? "'.endr' without '.rept'" : "unknown directive"),
+		len,
+		data
+	);
+	ctx->syn_err = true;
 }
 
 // Handles labels recursively
-void parseLine(char const *data, int len, bool parent_has_lab)
+void parseLine(Ctx *ctx, char const *data, int len, bool parent_has_lab)
 {
 	if (len == 0) {
 		return;
 	}
 
+	if (data[0] == '.') {
+		int start = wordIdx(ctx);
+		parseDirective(ctx, data, len);
+		growLisBuf(ctx, data, len, start);
+		return;
+	}
+
 	if (!(data[0] >= 'a' && data[0] <= 'z' || data[0] >= 'A' && data[0] <= 'Z')) {
 		fprintf(
-			stderr,
+			ctx->err,
 			COL_WHITE "%s:%d: " COL_RED "error: " COL_END "label names must begin with a letter\n"
 			"	%.*s\n",
-			src_name,
-			line_no,
+			ctx->src_name,
+			ctx->line_no,
 			len,
 			data
 		);
-		syn_err = true;
+		ctx->syn_err = true;
 		return;
 	}
 
@@ -614,58 +1666,59 @@ void parseLine(char const *data, int len, bool parent_has_lab)
 	}
 
 	if (i == len) {
-		has_lab = parent_has_lab;
+		ctx->has_lab = parent_has_lab;
 
-		parseSingle(data, len);
-		growLisBuf(data, len);
+		int start = wordIdx(ctx);
+		parseSingle(ctx, data, len);
+		growLisBuf(ctx, data, len, start);
 		return;
 	}
 
 	if (data[i] == ':') {
 		if (parent_has_lab) {
 			fprintf(
-				stderr,
+				ctx->err,
 				COL_WHITE "%s:%d: " COL_RED "error: " COL_END "multiple labels on a single line\n"
 				"	%.*s: %.*s\n",
-				src_name,
-				line_no,
-				defs.data[defs.len - 1].name_len,
-				defs.data[defs.len - 1].name,
+				ctx->src_name,
+				ctx->line_no,
+				ctx->defs.data[ctx->defs.len - 1].name_len,
+				ctx->defs.data[ctx->defs.len - 1].name,
 				len,
 				data
 			);
-			syn_err = true;
+			ctx->syn_err = true;
 			return;
 		}
 
-		for (int j = 0; j < defs.len; j++) {
-			if (defs.data[j].name_len == i && memcmp(defs.data[j].name, data, i) == 0) {
+		for (int j = 0; j < ctx->defs.len; j++) {
+			if (ctx->defs.data[j].name_len == i && memcmp(ctx->defs.data[j].name, data, i) == 0) {
 				fprintf(
-					stderr,
+					ctx->err,
 					COL_WHITE "%s:%d: " COL_RED "error: " COL_END "duplicate label definition\n"
 					"	%.*s\n",
-					src_name,
-					line_no,
+					ctx->src_name,
+					ctx->line_no,
 					len,
 					data
 				);
-				syn_err = true;
+				ctx->syn_err = true;
 				goto next_line;
 			}
 		}
 
 		// Allocate separate buffers for storing label names (line buffer gets overwritten)
-		char *name = tryMalloc(i);
+		char *name = arenaAlloc(&ctx->arena, i);
 		memcpy(name, data, i);
-		pushLabel(&defs, (Label) {
+		pushLabel(&ctx->defs, (Label) {
 			.name = name,
 			.name_len = i,
-			.line_no = line_no,
-			.word_idx = out_buf.len / 4,
+			.line_no = ctx->line_no,
+			.word_idx = wordIdx(ctx),
 			.used = false,
 		});
 
-		growLisBuf(data, i + 1);
+		growLisBuf(ctx, data, i + 1, wordIdx(ctx));
 
 next_line:
 		i++;
@@ -677,11 +1730,11 @@ next_line:
 			i++;
 		}
 
-		parseLine(data + i, len - i, true);
+		parseLine(ctx, data + i, len - i, true);
 		return;
 	}
 
-	has_lab = parent_has_lab;
+	ctx->has_lab = parent_has_lab;
 
 	int j = i;
 	while (data[j] == ' ' || data[j] == '\t') {
@@ -689,278 +1742,2303 @@ next_line:
 	}
 
 	int k = j;
-	while (k < len && (data[k] == '+' || data[k] == '-' || data[k] >= 'a' && data[k] <= 'z' || data[k] >= 'A' && data[k] <= 'Z' || data[k] >= '0' && data[k] <= '9')) {
+	while (k < len && (strchr("+-*/() \t", data[k]) != NULL || data[k] >= 'a' && data[k] <= 'z' || data[k] >= 'A' && data[k] <= 'Z' || data[k] >= '0' && data[k] <= '9')) {
 		k++;
 	}
 
 	if (k < len) {
 		fprintf(
-			stderr,
+			ctx->err,
 			COL_WHITE "%s:%d: " COL_RED "error: " COL_END "unexpected character '%c' after operand\n"
 			"	%.*s\n",
-			src_name,
-			line_no,
+			ctx->src_name,
+			ctx->line_no,
 			data[k],
 			len,
 			data
 		);
-		syn_err = true;
+		ctx->syn_err = true;
 		return;
 	}
 
-	parseDouble(data, i, data + j, len - j);
-	growLisBuf(data, len);
+	int start = wordIdx(ctx);
+	parseDouble(ctx, data, i, data + j, len - j);
+	growLisBuf(ctx, data, len, start);
 }
 
-void fillLabels()
+// Parses the recorded lines of a '.rept' block count times. Blocks that emit
+// only constant words are parsed once and their words copied; labels (which
+// would be defined again) and linkage are not allowed in them. Returns the word
+// index where copying started, for the '.endr' listing line.
+int expandRept(Ctx *ctx)
 {
-	for (int i = 0; i < uses.len; i++) {
-		for (int j = 0; j < defs.len; j++) {
-			if (!(defs.data[j].name_len == uses.data[i].name_len && memcmp(defs.data[j].name, uses.data[i].name, defs.data[j].name_len) == 0)) {
-				continue;
-			}
-
-			defs.data[j].used = true;
-
-			int use_word_idx = uses.data[i].word_idx;
-			int def_word_idx = defs.data[j].word_idx;
+	ctx->in_rept = false;
+
+	int line_no = ctx->line_no;
+	int num_defs = ctx->defs.len + ctx->exps.len + ctx->imps.len;
+	int uses_pushed = ctx->uses_pushed;
+	int flushed = ctx->flushed;
+	int start = wordIdx(ctx);
+
+	for (int rep = 0; rep < ctx->rept_count; rep++) {
+		int off = 0;
+		while (off < ctx->rept.len) {
+			ctx->line_no = getWord(&ctx->rept, off / 4);
+			int len = getWord(&ctx->rept, off / 4 + 1);
+			parseLine(ctx, ctx->rept.data + off + 8, len, false);
+
+			// Keep records word aligned
+			off += 8 + ((len + 3) & ~3);
+		}
+		ctx->line_no = line_no;
 
-			int write;
-			if (uses.data[i].br) {
-				write = def_word_idx - (use_word_idx + 1);
-			} else {
-				write = def_word_idx;
+		if (rep > 0) {
+			if (stream && ctx->out_buf.len >= STREAM_CHUNK && !flushWords(ctx)) {
+				ctx->syn_err = true;
+				break;
 			}
-
-			out_buf.data[4 * use_word_idx + 1] = write & 0xff;
-			out_buf.data[4 * use_word_idx + 2] = (write & 0xff00) >> 8;
-			out_buf.data[4 * use_word_idx + 3] = write >> 16;
-			goto next_use;
+			continue;
 		}
 
-		fprintf(
-			stderr,
-			COL_WHITE "%s:%d: " COL_RED "error: " COL_END "undefined label\n"
-			"	%.*s\n",
-			src_name,
-			uses.data[i].line_no,
-			uses.data[i].name_len,
-			uses.data[i].name
-		);
-		syn_err = true;
-
-next_use:	{}
-	}
-
-	for (int i = 0; i < defs.len; i++) {
-		if (!defs.data[i].used) {
+		if (ctx->defs.len + ctx->exps.len + ctx->imps.len != num_defs) {
 			fprintf(
-				stderr,
-				COL_WHITE "%s:%d: " COL_PUR "warning: " COL_END "unused label\n"
-				"	%.*s\n",
-				src_name,
-				defs.data[i].line_no,
-				defs.data[i].name_len,
-				defs.data[i].name
+				ctx->err,
+				COL_WHITE "%s:%d: " COL_RED "error: " COL_END "labels, 'export' and 'import' are not allowed in '.rept' blocks\n",
+				ctx->src_name,
+				ctx->rept_line
 			);
+			ctx->syn_err = true;
+		}
+
+		int n = wordIdx(ctx) - start;
+		if (ctx->syn_err || !checkCount(ctx, ".endr", 5, ctx->rept_count - 1, n)) {
+			break;
+		}
+
+		if (ctx->uses_pushed == uses_pushed && ctx->flushed == flushed) {
+			int copies = wordIdx(ctx);
+			repeatWords(ctx, start, ctx->rept_count - 1);
+			return copies;
 		}
 	}
+
+	return wordIdx(ctx);
 }
 
-void fillLisBuf()
+// Records a line of the '.rept' block being read, or expands it at '.endr'
+void reptLine(Ctx *ctx, char const *data, int len)
 {
-	int i = 9;
-	for (int j = 0; j < out_buf.len / 4; j++) {
-		int word = *(int *) (out_buf.data + 4 * j);
+	if (isStrzStrnEq(".endr", data, len)) {
+		int start = expandRept(ctx);
+		growLisBuf(ctx, data, len, start);
+		return;
+	}
+
+	if (len >= 5 && memcmp(data, ".rept", 5) == 0) {
+		fprintf(
+			ctx->err,
+			COL_WHITE "%s:%d: " COL_RED "error: " COL_END "nested '.rept' blocks are not supported\n"
+			"	%.*s\n",
+			ctx->src_name,
+			ctx->line_no,
+			len,
+			data
+		);
+		ctx->syn_err = true;
+		return;
+	}
+
+	if (len == 0) {
+		return;
+	}
+
+	pushWord(&ctx->rept, ctx->line_no);
+	pushWord(&ctx->rept, len);
+	pushSpan(&ctx->rept, data, len);
+	while (ctx->rept.len % 4 != 0) {
+		push(&ctx->rept, 0);
+	}
+}
+
+void printUnused(Ctx *ctx, int line_no, char const *name, int name_len)
+{
+	fprintf(
+		ctx->err,
+		COL_WHITE "%s:%d: " COL_PUR "warning: " COL_END "unused label\n"
+		"	%.*s\n",
+		ctx->src_name,
+		line_no,
+		name_len,
+		name
+	);
+}
+
+// Warnings are also stored as "<kind> <args>" records, so that cache hits can
+// replay them under the current file name (see replayWarnings())
+void storeWarning(Ctx *ctx, char const *rec, int len)
+{
+	if (cache_dir != NULL) {
+		pushSpan(&ctx->warn, rec, len);
+	}
+}
+
+void warnUnused(Ctx *ctx, int line_no, char const *name, int name_len)
+{
+	printUnused(ctx, line_no, name, name_len);
+
+	char num[16];
+	storeWarning(ctx, num, snprintf(num, sizeof (num), "u %d ", line_no));
+	storeWarning(ctx, name, name_len);
+	storeWarning(ctx, "\n", 1);
+}
+
+void printLiteralAddr(Ctx *ctx, char const *opt_name, int last)
+{
+	fprintf(
+		ctx->err,
+		COL_WHITE "%s: " COL_PUR "warning: " COL_END "'%s' left words 0 to %d unchanged, as the program may address word %d by number\n",
+		ctx->src_name,
+		opt_name,
+		last,
+		last
+	);
+}
+
+// kind is 'o' for -O and 'l' for -profile
+void warnLiteralAddr(Ctx *ctx, char kind, int last)
+{
+	printLiteralAddr(ctx, kind == 'o' ? "-O" : "-profile", last);
+
+	char rec[32];
+	storeWarning(ctx, rec, snprintf(rec, sizeof (rec), "%c %d\n", kind, last));
+}
+
+void printProfileSize(Ctx *ctx, int words)
+{
+	fprintf(
+		ctx->err,
+		COL_WHITE "%s: " COL_PUR "warning: " COL_END "profile '%s' is for a %d word image, not %d words; ignoring it\n",
+		ctx->src_name,
+		prof_name,
+		prof_words,
+		words
+	);
+}
+
+void warnProfileSize(Ctx *ctx, int words)
+{
+	printProfileSize(ctx, words);
+
+	char rec[32];
+	storeWarning(ctx, rec, snprintf(rec, sizeof (rec), "p %d\n", words));
+}
+
+// Prints the warnings stored in ctx->warn
+void replayWarnings(Ctx *ctx)
+{
+	for (int i = 0; i < ctx->warn.len;) {
+		char kind = ctx->warn.data[i];
+		char *end;
+		long num = strtol(ctx->warn.data + i + 2, &end, 10);
+
+		// Records end in '\n', so strtol() stops within them
+		i = end - ctx->warn.data;
+		int start = i + 1;
+		while (ctx->warn.data[i] != '\n') {
+			i++;
+		}
+
+		switch (kind) {
+			case 'u':
+				printUnused(ctx, num, ctx->warn.data + start, i - start);
+				break;
+			case 'o':
+			case 'l':
+				printLiteralAddr(ctx, kind == 'o' ? "-O" : "-profile", num);
+				break;
+			case 'p':
+				printProfileSize(ctx, num);
+				break;
+		}
+		i++;
+	}
+}
+
+#define NOTE_NONE	0
+#define NOTE_REMOVED	1
+#define NOTE_MERGED	2
+
+char const *const notes[] = {
+	"",
+	" ; removed",
+	" ; merged",
+};
+
+// Per-word optimizer flags
+#define F_TARGET	1
+#define F_DEL		2
+#define F_PIN		4
+#define F_LIT_BR	8
+
+bool fitsOp(int op)
+{
+	return op >= -(1 << 23) && op < (1 << 23);
+}
+
+// Whether the instruction overwrites b without reading it
+bool killsB(int ins)
+{
+	return ins == INS_LDC || ins == INS_LDL || ins == INS_SP2A || ins == INS_CALL || ins == INS_FADD || ins == INS_CID;
+}
+
+// Next word at or after i not deleted by the optimizer
+int nextLive(unsigned char const *flags, int i, int n)
+{
+	while (i < n && (flags[i] & F_DEL)) {
+		i++;
+	}
+
+	return i;
+}
+
+// Whether any word in [from, to] is a branch/label target
+bool anyTarget(unsigned char const *flags, int from, int to)
+{
+	for (int i = from; i <= to; i++) {
+		if (flags[i] & F_TARGET) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Removes a word's label use, keeping its definition from being reported as unused
+void dropUse(Ctx *ctx, int use)
+{
+	Label *lab = &ctx->uses.data[use];
+
+	int def = (lab->expr ? -1 : findLabel(&ctx->defs, lab->name, lab->name_len));
+	if (def >= 0) {
+		ctx->defs.data[def].used = true;
+	} else if (lab->expr) {
+		markExprUsed(ctx, lab->name, lab->name_len);
+	}
+
+	lab->word_idx = -1;
+}
+
+// Moves word i to map[i] (deleted words map to wherever execution continues) and
+// updates labels, literal branch displacements and listing lines to match
+void remapWords(Ctx *ctx, int const *map, unsigned char const *flags, unsigned char const *note, int n, int live)
+{
+	int *words = arenaAllocAligned(&ctx->arena, n * sizeof (int));
+	char *kinds = arenaAlloc(&ctx->arena, n);
+	memcpy(words, ctx->out_buf.data, 4 * n);
+	memcpy(kinds, ctx->kinds.data, n);
+
+	for (int i = 0; i < n; i++) {
+		if (flags[i] & F_DEL) {
+			continue;
+		}
+
+		int word = words[i];
+		*(int *) (ctx->out_buf.data + 4 * map[i]) = word;
+		ctx->kinds.data[map[i]] = kinds[i];
+
+		if (flags[i] & F_LIT_BR) {
+			int target = i + 1 + (word >> 8);
+			if (target >= 0 && target <= n) {
+				setOp(&ctx->out_buf, map[i], map[target] - (map[i] + 1));
+			}
+		}
+	}
+	ctx->out_buf.len = 4 * live;
+	ctx->kinds.len = live;
+
+	for (int i = 0; i < ctx->defs.len; i++) {
+		Label *def = &ctx->defs.data[i];
+		if (!def->abs && def->word_idx >= 0 && def->word_idx <= n) {
+			def->word_idx = map[def->word_idx];
+		}
+	}
+
+	int num_uses = 0;
+	for (int i = 0; i < ctx->uses.len; i++) {
+		Label use = ctx->uses.data[i];
+		if (use.word_idx >= 0) {
+			use.word_idx = map[use.word_idx];
+			ctx->uses.data[num_uses++] = use;
+		}
+	}
+	ctx->uses.len = num_uses;
+
+	for (int i = 0; i < ctx->lis.len; i++) {
+		LisEnt *ent = &ctx->lis.data[i];
+		if (ent->word_idx >= 0 && ent->word_idx < n) {
+			ent->note = note[ent->word_idx];
+			ent->word_idx = (flags[ent->word_idx] & F_DEL) ? -1 : map[ent->word_idx];
+		}
+
+		if (ent->addr >= 0 && ent->addr <= n) {
+			ent->addr = map[ent->addr];
+		}
+	}
+}
+
+#define TRK_UNKNOWN	0
+#define TRK_LIT		1
+#define TRK_SP		2
+
+// Contents of a or b as traced by lastLiteralAddr(): unknown, a number, or sp
+// plus a number (from sp2a while sp is not known)
+typedef struct {
+	int	kind;
+	long	val;
+} Traced;
+
+typedef struct {
+	long	last;
+	int	n;
+
+	// Accesses at sp plus a number where sp is not known: the highest such
+	// number, the highest literal sp that reached them, and the sum of the
+	// positive adj applied to it
+	bool	any_access;
+	long	max_off;
+	bool	any_base;
+	long	max_base;
+	long	drift;
+} AddrScan;
+
+void pinAddr(AddrScan *scan, long addr)
+{
+	if (addr < scan->n && addr > scan->last) {
+		scan->last = addr;
+	}
+}
+
+void unknownSpAccess(AddrScan *scan, long off)
+{
+	if (!scan->any_access || off > scan->max_off) {
+		scan->max_off = off;
+	}
+	scan->any_access = true;
+}
+
+// A value that is still in a or b when tracing stops may be used as an address later
+void escapeAddr(AddrScan *scan, Traced t)
+{
+	if (t.kind == TRK_LIT) {
+		pinAddr(scan, t.val);
+	} else if (t.kind == TRK_SP) {
+		unknownSpAccess(scan, t.val);
+	}
+}
+
+void leakSp(AddrScan *scan, bool sp_known, long sp)
+{
+	if (sp_known && (!scan->any_base || sp > scan->max_base)) {
+		scan->max_base = sp;
+		scan->any_base = true;
+	}
+}
 
-		while (lis_buf.data[i] == ' ') {
-			i += 9;
+// Operand of word i as a number, through SET labels; false for other label uses
+bool literalOp(Ctx const *ctx, int const *use_of, int i, long *op)
+{
+	int use = use_of[i];
+	if (use < 0) {
+		*op = getWord(&ctx->out_buf, i) >> 8;
+		return true;
+	}
+
+	Label const *lab = &ctx->uses.data[use];
+	int def = (lab->expr ? -1 : findLabel(&ctx->defs, lab->name, lab->name_len));
+	if (def >= 0 && ctx->defs.data[def].abs) {
+		*op = ctx->defs.data[def].word_idx;
+		return true;
+	}
+
+	return false;
+}
+
+// Highest word index below n that the program may address by number rather
+// than through a label, or -1. remapWords() cannot follow such addresses, so the
+// optimizers keep the words up to there where they are.
+//
+// Numbers from ldc (literal or SET) are traced through a, b and sp along
+// straight-line code. One is taken for an address when it is the base of
+// ldnl/stnl, is moved into sp, is returned to, or is still in a or b at a
+// branch, call or label. Accesses relative to sp count while sp holds such a
+// number (it starts at 0). Numbers stored to memory or kept in 'data' words
+// are not followed.
+int lastLiteralAddr(Ctx const *ctx, int const *use_of, unsigned char const *flags, int n)
+{
+	AddrScan scan = {
+		.last	= -1,
+		.n	= n,
+	};
+
+	Traced a = { TRK_UNKNOWN, 0 };
+	Traced b = { TRK_UNKNOWN, 0 };
+	bool sp_known = false;
+	long sp = 0;
+	bool in_block = false;
+
+	// If word 0 can be reached again, its initial sp of 0 outlives the first block
+	if (n > 0 && ((flags[0] & F_TARGET) || ctx->kinds.data[0] != WORD_INS)) {
+		leakSp(&scan, true, 0);
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (in_block && ((flags[i] & F_TARGET) || ctx->kinds.data[i] != WORD_INS)) {
+			escapeAddr(&scan, a);
+			escapeAddr(&scan, b);
+			leakSp(&scan, sp_known, sp);
+			in_block = false;
+		}
+
+		if (ctx->kinds.data[i] != WORD_INS) {
+			continue;
+		}
+
+		if (!in_block) {
+			a = b = (Traced) { TRK_UNKNOWN, 0 };
+			sp_known = (i == 0 && !(flags[0] & F_TARGET));
+			sp = 0;
+			in_block = true;
+		}
+
+		int ins = getWord(&ctx->out_buf, i) & 0xff;
+
+		// A label operand has its address remapped, so counts as 0 on top of a number
+		long op;
+		bool lit = literalOp(ctx, use_of, i, &op);
+		if (!lit) {
+			op = 0;
+		}
+
+		switch (ins) {
+			case INS_LDC:
+				b = a;
+				a = (lit ? (Traced) { TRK_LIT, op } : (Traced) { TRK_UNKNOWN, 0 });
+				break;
+
+			case INS_ADC:
+				if (!lit) {
+					a.kind = TRK_UNKNOWN;
+				}
+				a.val += op;
+				break;
+
+			case INS_LDL:
+			case INS_STL:
+			case INS_FADD:
+			case INS_CAS:
+				if (sp_known) {
+					pinAddr(&scan, sp + op);
+				} else {
+					unknownSpAccess(&scan, op);
+				}
+
+				if (ins == INS_STL) {
+					a = b;
+				} else {
+					if (ins != INS_CAS) {
+						b = a;
+					}
+					a = (Traced) { TRK_UNKNOWN, 0 };
+				}
+				break;
+
+			case INS_LDNL:
+			case INS_STNL:
+				if (a.kind == TRK_LIT) {
+					pinAddr(&scan, a.val + op);
+				} else if (a.kind == TRK_SP) {
+					unknownSpAccess(&scan, a.val + op);
+				}
+
+				if (ins == INS_LDNL) {
+					a = (Traced) { TRK_UNKNOWN, 0 };
+				}
+				break;
+
+			// An address plus or minus an unknown index is taken to stay near the address
+			case INS_ADD:
+				if (a.kind == TRK_UNKNOWN) {
+					a = b;
+				} else if (a.kind == TRK_LIT && b.kind != TRK_UNKNOWN) {
+					a = (Traced) { b.kind, b.val + a.val };
+				} else if (a.kind == TRK_SP && b.kind == TRK_LIT) {
+					a.val += b.val;
+				} else if (b.kind == TRK_SP) {
+					a = (Traced) { TRK_UNKNOWN, 0 };
+				}
+				break;
+
+			case INS_SUB:
+				if (b.kind == TRK_UNKNOWN || a.kind == TRK_SP) {
+					a = (Traced) { TRK_UNKNOWN, 0 };
+				} else if (a.kind == TRK_UNKNOWN) {
+					a = b;
+				} else {
+					a = (Traced) { b.kind, b.val - a.val };
+				}
+				break;
+
+			case INS_SHL:
+			case INS_SHR:
+				a = (Traced) { TRK_UNKNOWN, 0 };
+				break;
+
+			case INS_ADJ:
+				if (sp_known) {
+					sp += op;
+				} else if (op > 0) {
+					scan.drift += op;
+				}
+				break;
+
+			case INS_A2SP:
+				sp_known = (a.kind == TRK_LIT);
+				sp = a.val;
+				if (a.kind == TRK_SP && a.val > 0) {
+					scan.drift += a.val;
+				}
+				a = b;
+				break;
+
+			case INS_SP2A:
+				b = a;
+				a = (sp_known ? (Traced) { TRK_LIT, sp } : (Traced) { TRK_SP, 0 });
+				break;
+
+			case INS_CID:
+				b = a;
+				a = (Traced) { TRK_UNKNOWN, 0 };
+				break;
+
+			case INS_RETURN:
+				if (a.kind == TRK_LIT) {
+					pinAddr(&scan, a.val + 1);
+				}
+				escapeAddr(&scan, b);
+				leakSp(&scan, sp_known, sp);
+				in_block = false;
+				break;
+
+			case INS_HALT:
+				in_block = false;
+				break;
+
+			// Branches and calls, and unknown instructions
+			default:
+				escapeAddr(&scan, a);
+				escapeAddr(&scan, b);
+				leakSp(&scan, sp_known, sp);
+				in_block = false;
+				break;
+		}
+	}
+
+	if (scan.any_access && scan.any_base) {
+		pinAddr(&scan, scan.max_base + scan.max_off + scan.drift);
+	}
+
+	return scan.last;
+}
+
+// Flags label and literal branch targets, and literal branches (use_of[i] is the label use of word i, or -1)
+void markTargets(Ctx *ctx, int *use_of, unsigned char *flags, int n)
+{
+	memset(flags, 0, n + 1);
+	for (int i = 0; i < n; i++) {
+		use_of[i] = -1;
+	}
+
+	for (int i = 0; i < ctx->uses.len; i++) {
+		use_of[ctx->uses.data[i].word_idx] = i;
+	}
+
+	for (int i = 0; i < ctx->defs.len; i++) {
+		Label const *def = &ctx->defs.data[i];
+		if (!def->abs && def->word_idx >= 0 && def->word_idx <= n) {
+			flags[def->word_idx] |= F_TARGET;
+		}
+	}
+
+	for (int i = 0; i < n; i++) {
+		int ins = getWord(&ctx->out_buf, i) & 0xff;
+		if (ctx->kinds.data[i] != WORD_INS || use_of[i] >= 0 || ins < BR_BEGIN_IDX || ins > BR_END_IDX || ins == BR_BEGIN_IDX + 1) {
+			continue;
+		}
+
+		flags[i] |= F_LIT_BR;
+
+		int target = i + 1 + (getWord(&ctx->out_buf, i) >> 8);
+		if (target >= 0 && target <= n) {
+			flags[target] |= F_TARGET;
+		}
+	}
+}
+
+// Peephole optimizer (-O), run on the parsed words before fillLabels().
+// Deletes no-op branches/adjustments, merges consecutive 'adc'/'adj', and removes
+// 'ldc 0; add' and 'ldl x; stl x' where b is overwritten before being read again.
+// Labels, literal branch displacements and listing lines are remapped afterwards.
+// Words up to lastLiteralAddr() are left alone.
+void peephole(Ctx *ctx)
+{
+	int n = ctx->out_buf.len / 4;
+
+	int *use_of = arenaAllocAligned(&ctx->arena, n * sizeof (int));
+	int *map = arenaAllocAligned(&ctx->arena, (n + 1) * sizeof (int));
+	unsigned char *flags = arenaAllocAligned(&ctx->arena, n + 1);
+	unsigned char *note = arenaAllocAligned(&ctx->arena, n);
+
+	memset(note, NOTE_NONE, n);
+	markTargets(ctx, use_of, flags, n);
+
+	int last_lit = lastLiteralAddr(ctx, use_of, flags, n);
+	bool held = false;
+
+	for (int i = 0; i < n; i++) {
+		if (ctx->kinds.data[i] != WORD_INS || (flags[i] & (F_DEL | F_PIN))) {
+			continue;
+		}
+
+		// Changes below start at word i and shift or rewrite it
+		bool hold = (i <= last_lit);
+
+		int word = getWord(&ctx->out_buf, i);
+		int ins = word & 0xff;
+		int op = word >> 8;
+		int use = use_of[i];
+
+		// Branches to the next word and zero adjustments
+		bool nop = false;
+		if (ins == INS_BR || ins == INS_BRZ || ins == INS_BRLZ) {
+			if (use < 0) {
+				nop = (op == 0);
+			} else {
+				int def = findLabel(&ctx->defs, ctx->uses.data[use].name, ctx->uses.data[use].name_len);
+				nop = (def >= 0 && !ctx->defs.data[def].abs && ctx->defs.data[def].word_idx == i + 1);
+			}
+		} else if (ins == INS_ADC || ins == INS_ADJ) {
+			nop = (use < 0 && op == 0);
+		}
+
+		if (nop && hold) {
+			held = true;
+			continue;
+		}
+
+		if (nop) {
+			flags[i] |= F_DEL;
+			note[i] = NOTE_REMOVED;
+			if (use >= 0) {
+				dropUse(ctx, use);
+			}
+			continue;
+		}
+
+		int j = nextLive(flags, i + 1, n);
+		if (j == n || ctx->kinds.data[j] != WORD_INS || (flags[j] & F_PIN) || anyTarget(flags, i + 1, j)) {
+			continue;
+		}
+
+		int word_j = getWord(&ctx->out_buf, j);
+		int ins_j = word_j & 0xff;
+		int op_j = word_j >> 8;
+		int use_j = use_of[j];
+
+		// adc x; adc y -> adc x+y (likewise for adj)
+		if ((ins == INS_ADC || ins == INS_ADJ) && ins_j == ins && use < 0 && use_j < 0 && fitsOp(op + op_j)) {
+			if (hold) {
+				held = true;
+				continue;
+			}
+
+			setOp(&ctx->out_buf, i, op + op_j);
+			flags[j] |= F_DEL;
+			note[i] = NOTE_MERGED;
+			note[j] = NOTE_REMOVED;
+
+			// Try merging the following word as well
+			i--;
+			continue;
+		}
+
+		bool same_op;
+		if (use < 0 || use_j < 0) {
+			same_op = (use < 0 && use_j < 0 && op == op_j);
+		} else {
+			Label const *a = &ctx->uses.data[use];
+			Label const *b = &ctx->uses.data[use_j];
+			same_op = (a->name_len == b->name_len && memcmp(a->name, b->name, a->name_len) == 0);
+		}
+
+		// Only clobber b, so removable if the next instruction overwrites b without reading it
+		bool pair_nop = (ins == INS_LDC && use < 0 && op == 0 && ins_j == INS_ADD) || (ins == INS_LDL && ins_j == INS_STL && same_op);
+		if (!pair_nop) {
+			continue;
+		}
+
+		int k = nextLive(flags, j + 1, n);
+		if (k == n || ctx->kinds.data[k] != WORD_INS || !killsB(getWord(&ctx->out_buf, k) & 0xff)) {
+			continue;
+		}
+
+		if (hold) {
+			held = true;
+			continue;
+		}
+
+		flags[i] |= F_DEL;
+		flags[j] |= F_DEL;
+		flags[k] |= F_PIN;
+		note[i] = NOTE_REMOVED;
+		note[j] = NOTE_REMOVED;
+		if (use >= 0) {
+			dropUse(ctx, use);
+		}
+		if (use_j >= 0) {
+			dropUse(ctx, use_j);
+		}
+	}
+
+	// Deleted words map to the next surviving word
+	int live = 0;
+	for (int i = 0; i < n; i++) {
+		map[i] = live;
+		if (!(flags[i] & F_DEL)) {
+			live++;
+		}
+	}
+	map[n] = live;
+
+	if (held) {
+		warnLiteralAddr(ctx, 'o', last_lit);
+	}
+
+	if (live < n) {
+		remapWords(ctx, map, flags, note, n, live);
+	}
+}
+
+// Whether execution never falls through word i (br, return, HALT)
+bool endsChain(Ctx const *ctx, int i)
+{
+	int ins = getWord(&ctx->out_buf, i) & 0xff;
+	return ctx->kinds.data[i] == WORD_INS && (ins == INS_BR || ins == BR_BEGIN_IDX + 1 || ins == INS_HALT);
+}
+
+typedef struct {
+	long	count;
+
+	// Chain ending in the branch, and the chain it branches to
+	int	from;
+	int	to;
+
+	// Word index of the branch
+	int	br;
+} Edge;
+
+int cmpEdges(void const *a, void const *b)
+{
+	long ca = ((Edge const *) a)->count;
+	long cb = ((Edge const *) b)->count;
+	return (ca < cb) - (ca > cb);
+}
+
+int emitChains(int const *head, int const *next, int chain, unsigned char const *flags, int *map, int pos)
+{
+	for (; chain >= 0; chain = next[chain]) {
+		for (int i = head[chain]; i < head[chain + 1]; i++) {
+			map[i] = pos;
+			if (!(flags[i] & F_DEL)) {
+				pos++;
+			}
+		}
+	}
+
+	return pos;
+}
+
+// Chains of code for layout(), indexed by chain, and the 'br's between them
+typedef struct {
+	int			n;
+	int			num_chains;
+	int const		*head;
+	long const		*heat;
+	unsigned char const	*fixed;
+	Edge const		*edges;
+	int			num_edges;
+
+	// Scratch space for planLayout()
+	int			*next;
+	long			*group_heat;
+	unsigned char		*group_fixed;
+	unsigned char		*has_pred;
+} Chains;
+
+// Links chains along the edges, hottest first, and places them: fills map,
+// marks the deleted 'br's in flags and returns the new image size. Chains up to
+// pinned keep their place in front, and 'br's up to last_lit stay.
+int planLayout(Chains const *c, int pinned, int last_lit, unsigned char *flags, int *map)
+{
+	int *next = c->next;
+	unsigned char *has_pred = c->has_pred;
+	for (int chain = 0; chain < c->num_chains; chain++) {
+		next[chain] = -1;
+		has_pred[chain] = false;
+	}
+
+	for (int i = 0; i < c->num_edges; i++) {
+		Edge const *edge = &c->edges[i];
+		if (next[edge->from] >= 0 || has_pred[edge->to] || edge->to <= pinned || edge->from < pinned || edge->br <= last_lit) {
+			continue;
+		}
+
+		// Would close a cycle of chains
+		int chain = edge->to;
+		while (chain >= 0 && chain != edge->from) {
+			chain = next[chain];
+		}
+		if (chain == edge->from) {
+			continue;
+		}
+
+		next[edge->from] = edge->to;
+		has_pred[edge->to] = true;
+		flags[edge->br] |= F_DEL;
+	}
+
+	// Group heat and fixedness are those of the whole sequence of chains
+	for (int chain = 0; chain < c->num_chains; chain++) {
+		c->group_heat[chain] = c->heat[chain];
+		c->group_fixed[chain] = c->fixed[chain];
+		if (has_pred[chain]) {
+			continue;
+		}
+
+		for (int i = next[chain]; i >= 0; i = next[i]) {
+			c->group_heat[chain] += c->heat[i];
+			c->group_fixed[chain] |= c->fixed[i];
+		}
+	}
+
+	int pos = 0;
+	for (int chain = 0; chain <= pinned; chain++) {
+		pos = emitChains(c->head, next, chain, flags, map, pos);
+	}
+	for (int pass = 0; pass < 3; pass++) {
+		for (int chain = pinned + 1; chain < c->num_chains; chain++) {
+			if (has_pred[chain]) {
+				continue;
+			}
+
+			int group_pass = (c->group_fixed[chain] ? 2 : c->group_heat[chain] > 0 ? 0 : 1);
+			if (group_pass == pass) {
+				pos = emitChains(c->head, next, chain, flags, map, pos);
+			}
+		}
+	}
+	map[c->n] = pos;
+
+	return pos;
+}
+
+// Profile-guided code layout (-profile), run before peephole() so that addresses
+// match the image the profile was taken on. Code is split into chains of words
+// that fall through into each other (ending at br, return or HALT). Following the
+// hottest 'br's first, the target chain is placed directly after the branching
+// chain and the 'br' is deleted. Cold code-only chains are moved behind the hot
+// ones, and chains holding data (or falling off the end of the image) keep their
+// relative order at the end. Chains up to the one holding lastLiteralAddr() stay
+// where they are.
+void layout(Ctx *ctx)
+{
+	int n = ctx->out_buf.len / 4;
+	if (prof_words != n) {
+		warnProfileSize(ctx, n);
+		return;
+	}
+
+	int *use_of = arenaAllocAligned(&ctx->arena, n * sizeof (int));
+	int *map = arenaAllocAligned(&ctx->arena, (n + 1) * sizeof (int));
+	int *chain_of = arenaAllocAligned(&ctx->arena, n * sizeof (int));
+	int *head = arenaAllocAligned(&ctx->arena, (n + 1) * sizeof (int));
+	long *heat = arenaAllocAligned(&ctx->arena, n * sizeof (long));
+	Edge *edges = arenaAllocAligned(&ctx->arena, n * sizeof (Edge));
+	unsigned char *flags = arenaAllocAligned(&ctx->arena, n + 1);
+	unsigned char *note = arenaAllocAligned(&ctx->arena, n);
+	unsigned char *fixed = arenaAllocAligned(&ctx->arena, n);
+
+	Chains c = {
+		.n		= n,
+		.head		= head,
+		.heat		= heat,
+		.fixed		= fixed,
+		.edges		= edges,
+		.next		= arenaAllocAligned(&ctx->arena, n * sizeof (int)),
+		.group_heat	= arenaAllocAligned(&ctx->arena, n * sizeof (long)),
+		.group_fixed	= arenaAllocAligned(&ctx->arena, n),
+		.has_pred	= arenaAllocAligned(&ctx->arena, n),
+	};
+
+	markTargets(ctx, use_of, flags, n);
+	memset(note, NOTE_NONE, n);
+
+	int num_chains = 0;
+	for (int i = 0; i < n; i++) {
+		if (i == 0 || endsChain(ctx, i - 1)) {
+			head[num_chains] = i;
+			heat[num_chains] = 0;
+			fixed[num_chains] = false;
+			num_chains++;
+		}
+
+		int chain = num_chains - 1;
+		chain_of[i] = chain;
+		heat[chain] += prof_count[i];
+		if (ctx->kinds.data[i] != WORD_INS) {
+			fixed[chain] = true;
+		}
+	}
+	head[num_chains] = n;
+	c.num_chains = num_chains;
+
+	if (n > 0 && !endsChain(ctx, n - 1)) {
+		fixed[num_chains - 1] = true;
+	}
+
+	int num_edges = 0;
+	for (int chain = 0; chain < num_chains; chain++) {
+		int br = head[chain + 1] - 1;
+		if (!endsChain(ctx, br) || (getWord(&ctx->out_buf, br) & 0xff) != INS_BR || prof_count[br] == 0) {
+			continue;
+		}
+
+		int target;
+		if (use_of[br] < 0) {
+			target = br + 1 + (getWord(&ctx->out_buf, br) >> 8);
+		} else {
+			Label const *use = &ctx->uses.data[use_of[br]];
+			int def = findLabel(&ctx->defs, use->name, use->name_len);
+			if (def < 0 || ctx->defs.data[def].abs) {
+				continue;
+			}
+			target = ctx->defs.data[def].word_idx;
+		}
+
+		if (target < 0 || target >= n || head[chain_of[target]] != target) {
+			continue;
+		}
+
+		int to = chain_of[target];
+		if (to == chain || to == 0 || fixed[to]) {
+			continue;
+		}
+
+		edges[num_edges++] = (Edge) {
+			.count	= prof_count[br],
+			.from	= chain,
+			.to	= to,
+			.br	= br,
+		};
+	}
+
+	qsort(edges, num_edges, sizeof (Edge), cmpEdges);
+	c.num_edges = num_edges;
+
+	int last_lit = lastLiteralAddr(ctx, use_of, flags, n);
+	int pinned = (last_lit >= 0 ? chain_of[last_lit] : 0);
+
+	// Warn only if the pinned words would otherwise have moved
+	if (last_lit >= 0) {
+		int *free_map = arenaAllocAligned(&ctx->arena, (n + 1) * sizeof (int));
+		unsigned char *free_flags = arenaAllocAligned(&ctx->arena, n + 1);
+		memcpy(free_flags, flags, n + 1);
+		planLayout(&c, 0, -1, free_flags, free_map);
+
+		bool held = false;
+		for (int i = 0; i <= last_lit; i++) {
+			held |= (free_map[i] != i || (free_flags[i] & F_DEL));
+		}
+		if (held) {
+			warnLiteralAddr(ctx, 'l', last_lit);
+		}
+	}
+
+	int pos = planLayout(&c, pinned, last_lit, flags, map);
+
+	bool changed = (pos != n);
+	for (int i = 0; i < n; i++) {
+		changed |= (map[i] != i);
+	}
+
+	for (int i = 0; i < num_edges; i++) {
+		int br = edges[i].br;
+		if (flags[br] & F_DEL) {
+			note[br] = NOTE_REMOVED;
+			if (use_of[br] >= 0) {
+				dropUse(ctx, use_of[br]);
+			}
+		}
+	}
+
+	if (changed) {
+		remapWords(ctx, map, flags, note, n, pos);
+	}
+}
+
+#define RELOC_ABS	0
+#define RELOC_PCREL	1
+
+void pushReloc(Ctx *ctx, int word_idx, int sym, int kind)
+{
+	pushWord(&ctx->relocs, word_idx);
+	pushWord(&ctx->relocs, sym);
+	pushWord(&ctx->relocs, kind);
+}
+
+void fillLabels(Ctx *ctx)
+{
+	int line_no = ctx->line_no;
+	for (int i = 0; i < ctx->uses.len; i++) {
+		Label const *use = &ctx->uses.data[i];
+
+		if (use->expr) {
+			// Errors point at the line of the use
+			ctx->line_no = use->line_no;
+
+			Val val;
+			if (evalExpr(ctx, use->name, use->name_len, true, &val) != EXPR_OK) {
+				continue;
+			}
+
+			// Only a single address plus a constant moves with the load address
+			bool moves = (val.addrs != 0 && !use->br);
+			if (reloc_out && (val.scaled || val.addrs < 0 || val.addrs > 1 || (moves && use->word))) {
+				fprintf(
+					ctx->err,
+					COL_WHITE "%s:%d: " COL_RED "error: " COL_END "expression cannot be relocated\n"
+					"	%.*s\n",
+					ctx->src_name,
+					use->line_no,
+					use->name_len,
+					use->name
+				);
+				ctx->syn_err = true;
+				continue;
+			}
+
+			if (reloc_out && moves) {
+				pushReloc(ctx, use->word_idx, -1, RELOC_ABS);
+			}
+
+			writeUse(ctx, use, use->br ? val.val - (use->word_idx + 1) : val.val);
+			continue;
+		}
+
+		int j = findLabel(&ctx->defs, use->name, use->name_len);
+		if (j >= 0) {
+			ctx->defs.data[j].used = true;
+
+			int use_word_idx = use->word_idx;
+			int def_word_idx = ctx->defs.data[j].word_idx;
+
+			int write;
+			if (use->br) {
+				write = def_word_idx - (use_word_idx + 1);
+			} else {
+				write = def_word_idx;
+
+				// Addresses move with the object's load address
+				if (reloc_out && !ctx->defs.data[j].abs) {
+					pushReloc(ctx, use_word_idx, -1, RELOC_ABS);
+				}
+			}
+
+			writeUse(ctx, use, write);
+			continue;
+		}
+
+		// Imports follow exports in the symbol table
+		j = findLabel(&ctx->imps, use->name, use->name_len);
+		if (j >= 0) {
+			ctx->imps.data[j].used = true;
+			pushReloc(ctx, use->word_idx, ctx->exps.len + j, use->br ? RELOC_PCREL : RELOC_ABS);
+			continue;
+		}
+
+		fprintf(
+			ctx->err,
+			COL_WHITE "%s:%d: " COL_RED "error: " COL_END "undefined label\n"
+			"	%.*s\n",
+			ctx->src_name,
+			use->line_no,
+			use->name_len,
+			use->name
+		);
+		ctx->syn_err = true;
+	}
+	ctx->line_no = line_no;
+
+	for (int i = 0; i < ctx->exps.len; i++) {
+		Label *exp = &ctx->exps.data[i];
+
+		int j = findLabel(&ctx->defs, exp->name, exp->name_len);
+		if (j < 0) {
+			fprintf(
+				ctx->err,
+				COL_WHITE "%s:%d: " COL_RED "error: " COL_END "undefined exported label\n"
+				"	%.*s\n",
+				ctx->src_name,
+				exp->line_no,
+				exp->name_len,
+				exp->name
+			);
+			ctx->syn_err = true;
+			continue;
+		}
+
+		ctx->defs.data[j].used = true;
+		exp->word_idx = ctx->defs.data[j].word_idx;
+		exp->abs = ctx->defs.data[j].abs;
+	}
+
+	for (int i = 0; i < ctx->imps.len; i++) {
+		Label const *imp = &ctx->imps.data[i];
+
+		int j = findLabel(&ctx->defs, imp->name, imp->name_len);
+		if (j >= 0) {
+			fprintf(
+				ctx->err,
+				COL_WHITE "%s:%d: " COL_RED "error: " COL_END "imported label is also defined\n"
+				"	%.*s\n",
+				ctx->src_name,
+				ctx->defs.data[j].line_no,
+				imp->name_len,
+				imp->name
+			);
+			ctx->syn_err = true;
+		}
+	}
+
+	for (int i = 0; i < ctx->defs.len; i++) {
+		if (!ctx->defs.data[i].used) {
+			warnUnused(ctx, ctx->defs.data[i].line_no, ctx->defs.data[i].name, ctx->defs.data[i].name_len);
+		}
+	}
+}
+
+#define RO_MAGIC	"SRO1"
+#define SYM_EXPORT	1
+#define SYM_IMPORT	2
+#define SYM_ABS		4
+
+void pushSyms(Buf *buf, LabelBuf const *syms, int flags, int *name_off)
+{
+	for (int i = 0; i < syms->len; i++) {
+		pushWord(buf, *name_off);
+		pushWord(buf, syms->data[i].name_len);
+		pushWord(buf, syms->data[i].word_idx);
+		pushWord(buf, flags | (syms->data[i].abs ? SYM_ABS : 0));
+		*name_off += syms->data[i].name_len;
+	}
+}
+
+// Relocatable object: header, words, symbols, relocations, string table (see ld.c)
+void fillRoBuf(Ctx *ctx, Buf *buf)
+{
+	int strtab_len = 0;
+	for (int i = 0; i < ctx->exps.len; i++) {
+		strtab_len += ctx->exps.data[i].name_len;
+	}
+	for (int i = 0; i < ctx->imps.len; i++) {
+		strtab_len += ctx->imps.data[i].name_len;
+	}
+
+	buf->len = 0;
+	pushSpan(buf, RO_MAGIC, 4);
+	pushWord(buf, ctx->out_buf.len / 4);
+	pushWord(buf, ctx->exps.len + ctx->imps.len);
+	pushWord(buf, ctx->relocs.len / 12);
+	pushWord(buf, strtab_len);
+
+	pushSpan(buf, ctx->out_buf.data, ctx->out_buf.len);
+
+	int name_off = 0;
+	pushSyms(buf, &ctx->exps, SYM_EXPORT, &name_off);
+	pushSyms(buf, &ctx->imps, SYM_IMPORT, &name_off);
+
+	pushSpan(buf, ctx->relocs.data, ctx->relocs.len);
+
+	for (int i = 0; i < ctx->exps.len; i++) {
+		pushSpan(buf, ctx->exps.data[i].name, ctx->exps.data[i].name_len);
+	}
+	for (int i = 0; i < ctx->imps.len; i++) {
+		pushSpan(buf, ctx->imps.data[i].name, ctx->imps.data[i].name_len);
+	}
+}
+
+// Single forward pass over the recorded listing lines
+void fillLisBuf(Ctx *ctx)
+{
+	int len = 0;
+	for (int i = 0; i < ctx->lis.len; i++) {
+		len += 18 + ctx->lis.data[i].src_len + strlen(notes[ctx->lis.data[i].note]) + 1;
+	}
+
+	// Room for the terminating null byte appended by sprintf()
+	reserve(&ctx->lis_buf, len + 1);
+
+	char *out = ctx->lis_buf.data;
+	for (int i = 0; i < ctx->lis.len; i++) {
+		LisEnt const *ent = &ctx->lis.data[i];
+
+		if (ent->addr >= 0) {
+			sprintf(out, "%08x", ent->addr);
+		} else {
+			memset(out, ' ', 8);
+		}
+		out[8] = ' ';
+
+		if (ent->word_idx >= 0) {
+			sprintf(out + 9, "%08x", *(int *) (ctx->out_buf.data + 4 * ent->word_idx));
+		} else {
+			memset(out + 9, ' ', 8);
+		}
+		out[17] = ' ';
+
+		memcpy(out + 18, ctx->lis_src.data + ent->src_off, ent->src_len);
+		out += 18 + ent->src_len;
+
+		int note_len = strlen(notes[ent->note]);
+		memcpy(out, notes[ent->note], note_len);
+		out[note_len] = '\n';
+		out += note_len + 1;
+	}
+
+	ctx->lis_buf.len = len;
+}
+
+typedef enum {
+	JOB_OK,
+	JOB_SYN_ERR,
+	JOB_FATAL,
+} JobStatus;
+
+typedef struct {
+	char const	*src_name;
+	JobStatus	status;
+
+	// Whether a worker ran the job (none are started after a fatal error)
+	bool		ran;
+
+	// Buffered diagnostics
+	char		*diag;
+	size_t		diag_len;
+
+	// Buffered JSON time report (with -time-report=json)
+	char		*report;
+	size_t		report_len;
+} Job;
+
+#define INIT_CAP	64
+
+void initCtx(Ctx *ctx)
+{
+	*ctx = (Ctx) {
+		.line		= { .cap = INIT_CAP },
+
+		// Separate buffer as input file may not have an extension
+		.out_name	= { .cap = INIT_CAP },
+
+		.out_buf	= { .cap = INIT_CAP },
+		.lis_buf	= { .cap = INIT_CAP },
+		.lis		= { .cap = INIT_CAP },
+		.lis_src	= { .cap = INIT_CAP },
+		.defs		= { .cap = INIT_CAP },
+		.uses		= { .cap = INIT_CAP },
+		.src_data	= { .cap = INIT_CAP },
+		.cache_path	= { .cap = INIT_CAP },
+		.warn		= { .cap = INIT_CAP },
+		.exps		= { .cap = INIT_CAP },
+		.imps		= { .cap = INIT_CAP },
+		.relocs		= { .cap = INIT_CAP },
+		.ro_buf		= { .cap = INIT_CAP },
+		.kinds		= { .cap = INIT_CAP },
+		.rept		= { .cap = INIT_CAP },
+	};
+
+	ctx->line.data = tryMalloc(INIT_CAP);
+	ctx->out_name.data = tryMalloc(INIT_CAP);
+	ctx->out_buf.data = tryMalloc(INIT_CAP);
+	ctx->lis_buf.data = tryMalloc(INIT_CAP);
+	ctx->lis.data = tryMalloc(INIT_CAP * sizeof (LisEnt));
+	ctx->lis_src.data = tryMalloc(INIT_CAP);
+	ctx->defs.data = tryMalloc(INIT_CAP * sizeof (Label));
+	ctx->uses.data = tryMalloc(INIT_CAP * sizeof (Label));
+	ctx->src_data.data = tryMalloc(INIT_CAP);
+	ctx->cache_path.data = tryMalloc(INIT_CAP);
+	ctx->warn.data = tryMalloc(INIT_CAP);
+	ctx->exps.data = tryMalloc(INIT_CAP * sizeof (Label));
+	ctx->imps.data = tryMalloc(INIT_CAP * sizeof (Label));
+	ctx->relocs.data = tryMalloc(INIT_CAP);
+	ctx->ro_buf.data = tryMalloc(INIT_CAP);
+	ctx->kinds.data = tryMalloc(INIT_CAP);
+	ctx->rept.data = tryMalloc(INIT_CAP);
+}
+
+void freeCtx(Ctx *ctx)
+{
+	free(ctx->line.data);
+	free(ctx->out_name.data);
+	free(ctx->out_buf.data);
+	free(ctx->lis_buf.data);
+	free(ctx->lis.data);
+	free(ctx->lis_src.data);
+	free(ctx->defs.data);
+	free(ctx->uses.data);
+	freeArena(&ctx->arena);
+	free(ctx->src_data.data);
+	free(ctx->cache_path.data);
+	free(ctx->warn.data);
+	free(ctx->exps.data);
+	free(ctx->imps.data);
+	free(ctx->relocs.data);
+	free(ctx->ro_buf.data);
+	free(ctx->kinds.data);
+	free(ctx->rept.data);
+}
+
+// Output path for the current file with the given extension (replacing the source's, or -o's, extension)
+void setOutName(Ctx *ctx, char const *ext)
+{
+	char const *base = (out_path != NULL ? out_path : ctx->src_name);
+
+	int len = strlen(base);
+	for (int i = len - 1; i >= 0 && base[i] != '/'; i--) {
+		if (base[i] == '.') {
+			len = i;
+			break;
+		}
+	}
+
+	ctx->out_name.len = 0;
+	pushSpan(&ctx->out_name, base, len);
+	pushSpan(&ctx->out_name, ext, strlen(ext));
+
+	// Since creat() takes a null terminated string
+	push(&ctx->out_name, 0);
+	ctx->out_name.len--;
+}
+
+void setObjName(Ctx *ctx)
+{
+	if (out_path == NULL) {
+		setOutName(ctx, reloc_out ? ".ro" : ".o");
+		return;
+	}
+
+	ctx->out_name.len = 0;
+	pushSpan(&ctx->out_name, out_path, strlen(out_path) + 1);
+	ctx->out_name.len--;
+}
+
+// Returns false on fatal error (already reported to ctx->err)
+bool writeOutput(Ctx *ctx, Buf const *buf)
+{
+	int fd = creat(ctx->out_name.data, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		fprintf(ctx->err, COL_RED "fatal error: " COL_END "failed to create output file '%s': %s\n", ctx->out_name.data, strerror(errno));
+		return false;
+	}
+
+	PhaseMark mark = beginPhase();
+	int written = writeAll(fd, buf->data, buf->len);
+	endPhase(ctx, PHASE_WRITE, mark);
+
+	if (written < buf->len) {
+		fprintf(ctx->err, COL_RED "fatal error: " COL_END "failed to write to output file '%s': %s\n", ctx->out_name.data, strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	if (close(fd) < 0) {
+		fprintf(ctx->err, COL_RED "fatal error: " COL_END "failed to close output file '%s': %s\n", ctx->out_name.data, strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+// FNV-1a
+uint64_t hashBytes(uint64_t hash, char const *data, int len)
+{
+	for (int i = 0; i < len; i++) {
+		hash ^= (unsigned char) data[i];
+		hash *= 0x100000001b3;
+	}
+
+	return hash;
+}
+
+// Reads the whole source; returns false on read error
+bool readSrc(Ctx *ctx)
+{
+	ctx->src_data.len = 0;
+	while (true) {
+		grow(&ctx->src_data, 4096);
+
+		int len = fread(ctx->src_data.data + ctx->src_data.len, 1, ctx->src_data.cap - ctx->src_data.len, ctx->src);
+		ctx->src_data.len += len;
+		if (len == 0) {
+			break;
+		}
+	}
+
+	if (ferror(ctx->src)) {
+		return false;
+	}
+
+	if (ctx->own_src) {
+		fclose(ctx->src);
+	}
+
+	// Parse from memory, as stdin cannot be rewound (fmemopen() rejects empty buffers)
+	ctx->src = fmemopen(ctx->src_data.data, ctx->src_data.len > 0 ? ctx->src_data.len : 1, ctx->src_data.len > 0 ? "r" : "w+");
+	if (ctx->src == NULL) {
+		return false;
+	}
+
+	ctx->own_src = true;
+	return true;
+}
+
+uint64_t cacheKey(Ctx *ctx)
+{
+	char const flags[] = {
+		no_lst,
+		reloc_out,
+		opt,
+	};
+
+	uint64_t hash = 0xcbf29ce484222325;
+	hash = hashBytes(hash, ASM_VERSION, sizeof (ASM_VERSION));
+	hash = hashBytes(hash, flags, sizeof (flags));
+	hash = hashBytes(hash, prof_data.data, prof_data.len);
+	hash = hashBytes(hash, ctx->src_data.data, ctx->src_data.len);
+	return hash;
+}
+
+void setCachePath(Ctx *ctx, uint64_t key, char const *ext)
+{
+	int len = snprintf(NULL, 0, "%s/%016llx%s", cache_dir, (unsigned long long) key, ext);
+	reserve(&ctx->cache_path, len + 1);
+	snprintf(ctx->cache_path.data, len + 1, "%s/%016llx%s", cache_dir, (unsigned long long) key, ext);
+	ctx->cache_path.len = len;
+}
+
+// Reflinks (or copies) ctx->cache_path to ctx->out_name; returns 1 if the entry is missing, -1 on fatal error
+int copyFromCache(Ctx *ctx)
+{
+	int from = open(ctx->cache_path.data, O_RDONLY);
+	if (from < 0) {
+		return 1;
+	}
+
+	int to = creat(ctx->out_name.data, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (to < 0) {
+		fprintf(ctx->err, COL_RED "fatal error: " COL_END "failed to create output file '%s': %s\n", ctx->out_name.data, strerror(errno));
+		close(from);
+		return -1;
+	}
+
+	int ret = 0;
+	if (ioctl(to, FICLONE, from) < 0) {
+		while (true) {
+			ssize_t len = copy_file_range(from, NULL, to, NULL, 1 << 30, 0);
+			if (len > 0) {
+				continue;
+			}
+
+			if (len == 0) {
+				break;
+			}
+
+			// Fall back to read()/write() (e.g. across file systems)
+			char buf[1 << 14];
+			while ((len = read(from, buf, sizeof (buf))) > 0) {
+				if (writeAll(to, buf, len) < len) {
+					break;
+				}
+			}
+
+			if (len != 0) {
+				fprintf(ctx->err, COL_RED "fatal error: " COL_END "failed to copy '%s' to '%s': %s\n", ctx->cache_path.data, ctx->out_name.data, strerror(errno));
+				ret = -1;
+			}
+			break;
+		}
+	}
+
+	close(from);
+	if (close(to) < 0 && ret == 0) {
+		fprintf(ctx->err, COL_RED "fatal error: " COL_END "failed to close output file '%s': %s\n", ctx->out_name.data, strerror(errno));
+		ret = -1;
+	}
+
+	return ret;
+}
+
+// Returns false on a cache miss, setting *status on a hit
+bool loadFromCache(Ctx *ctx, uint64_t key, JobStatus *status)
+{
+	// The object file is stored last, so its presence marks a complete entry
+	setCachePath(ctx, key, ".o");
+	if (access(ctx->cache_path.data, R_OK) != 0) {
+		return false;
+	}
+
+	setCachePath(ctx, key, ".w");
+	int fd = open(ctx->cache_path.data, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
 
-			while (lis_buf.data[i] != '\n') {
-				i++;
-			}
+	ctx->warn.len = 0;
+	while (true) {
+		grow(&ctx->warn, 4096);
 
-			i += 10;
+		ssize_t len = read(fd, ctx->warn.data + ctx->warn.len, ctx->warn.cap - ctx->warn.len);
+		if (len <= 0) {
+			break;
 		}
+		ctx->warn.len += len;
+	}
+	close(fd);
 
-		sprintf(lis_buf.data + i, "%08x", word);
-		lis_buf.data[i + 8] = ' ';
+	*status = JOB_OK;
 
-		i += 9;
+	setCachePath(ctx, key, ".o");
+	setObjName(ctx);
+	int ret = copyFromCache(ctx);
+	if (ret == 0 && !no_lst) {
+		setCachePath(ctx, key, ".lst");
+		setOutName(ctx, ".lst");
+		ret = copyFromCache(ctx);
+	}
 
-		while (lis_buf.data[i] != '\n') {
-			i++;
-		}
+	if (ret > 0) {
+		// Evicted concurrently; assemble normally
+		return false;
+	}
 
-		i += 10;
+	if (ret < 0) {
+		*status = JOB_FATAL;
+		return true;
 	}
+
+	replayWarnings(ctx);
+
+	return true;
 }
 
-int writeAll(int fd, char const *data, int len)
+// Atomically publishes buf as a cache entry file; failures only cost a later cache miss
+void storeInCache(Ctx *ctx, uint64_t key, char const *ext, Buf const *buf)
 {
-	int written = 0;
-	int tot_written = 0;
-	while (tot_written < len && written >= 0) {
-		tot_written += written;
-		written = write(fd, data + tot_written, len - tot_written);
+	setCachePath(ctx, key, ".tmpXXXXXX");
+
+	int fd = mkstemp(ctx->cache_path.data);
+	if (fd < 0) {
+		return;
 	}
 
-	return tot_written;
+	bool ok = writeAll(fd, buf->data, buf->len) == buf->len;
+	ok = fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) == 0 && ok;
+	ok = close(fd) == 0 && ok;
+
+	char tmp[ctx->cache_path.len + 1];
+	memcpy(tmp, ctx->cache_path.data, ctx->cache_path.len + 1);
+
+	setCachePath(ctx, key, ext);
+	if (!ok || rename(tmp, ctx->cache_path.data) != 0) {
+		unlink(tmp);
+	}
 }
 
-int main(int argc, char *argv[])
+void printJsonString(FILE *file, char const *str)
+{
+	fputc('"', file);
+	for (; *str != 0; str++) {
+		if (*str == '"' || *str == '\\') {
+			fprintf(file, "\\%c", *str);
+		} else if ((unsigned char) *str < 0x20) {
+			fprintf(file, "\\u%04x", *str);
+		} else {
+			fputc(*str, file);
+		}
+	}
+	fputc('"', file);
+}
+
+void printTimeReport(Ctx *ctx, PhaseMark const *total, JobStatus status)
 {
-	if (argc == 1) {
+	double total_secs = secsSince(total);
+	long total_allocs = num_allocs - total->allocs;
+
+	if (time_report == REPORT_JSON) {
+		static char const *const status_names[] = { "ok", "error", "fatal" };
+
+		fprintf(ctx->report, "{\"file\": ");
+		printJsonString(ctx->report, ctx->src_name);
 		fprintf(
-			stderr,
-			COL_RED "fatal error: " COL_END "no input files\n"
-			"usage: %s <files>\n",
-			argv[0]
+			ctx->report,
+			", \"status\": \"%s\", \"lines\": %d, \"labels\": %d, \"uses\": %d, \"words\": %d, \"secs\": %.9f, \"allocs\": %ld, \"phases\": {",
+			status_names[status],
+			ctx->line_no,
+			ctx->defs.len,
+			ctx->uses.len,
+			wordIdx(ctx),
+			total_secs,
+			total_allocs
 		);
-		return EXIT_FAILURE;
+
+		for (int i = 0; i < NUM_PHASES; i++) {
+			fprintf(
+				ctx->report,
+				"%s\"%s\": {\"secs\": %.9f, \"allocs\": %ld}",
+				i > 0 ? ", " : "",
+				phase_names[i],
+				ctx->phases[i].secs,
+				ctx->phases[i].allocs
+			);
+		}
+		fprintf(ctx->report, "}}\n");
+		return;
 	}
 
-	line.data = tryMalloc(1);
+	fprintf(
+		ctx->err,
+		COL_WHITE "%s: " COL_END "time report: %d lines, %d labels, %d uses, %d words\n",
+		ctx->src_name,
+		ctx->line_no,
+		ctx->defs.len,
+		ctx->uses.len,
+		wordIdx(ctx)
+	);
 
-	// Separate buffer as input file may not have an extension
-	out_name.data = tryMalloc(1);
+	for (int i = 0; i < NUM_PHASES; i++) {
+		fprintf(ctx->err, "\t%-8s %10.6f s %8ld allocations\n", phase_names[i], ctx->phases[i].secs, ctx->phases[i].allocs);
+	}
+	fprintf(ctx->err, "\t%-8s %10.6f s %8ld allocations\n", "total", total_secs, total_allocs);
+}
 
-	out_buf.data = tryMalloc(1);
-	lis_buf.data = tryMalloc(1);
-	defs.data = tryMalloc(sizeof (Label));
-	uses.data = tryMalloc(sizeof (Label));
+JobStatus assembleFile(Ctx *ctx)
+{
+	long allocs_start = num_allocs;
 
-	int exit_code = EXIT_SUCCESS;
+	PhaseMark total_mark = beginPhase();
+	if (time_report) {
+		memset(ctx->phases, 0, sizeof (ctx->phases));
+	}
 
-	for (int i = 1; i < argc; i++) {
-		src_name = argv[i];
-		src = fopen(src_name, "r");
-		if (src == NULL) {
-			fprintf(stderr, COL_RED "fatal error: " COL_END "failed to open file '%s': %s\n", src_name, strerror(errno));
-			return EXIT_FAILURE;
+	if (ctx->own_src) {
+		ctx->src = fopen(ctx->src_name, "r");
+		if (ctx->src == NULL) {
+			fprintf(ctx->err, COL_RED "fatal error: " COL_END "failed to open file '%s': %s\n", ctx->src_name, strerror(errno));
+			return JOB_FATAL;
+		}
+	} else {
+		ctx->src = stdin;
+	}
+
+	ctx->line_no = 1;
+	ctx->out_buf.len = 0;
+	ctx->lis_buf.len = 0;
+	ctx->lis.len = 0;
+	ctx->lis_src.len = 0;
+	ctx->defs.len = 0;
+	ctx->uses.len = 0;
+	ctx->exps.len = 0;
+	ctx->imps.len = 0;
+	ctx->relocs.len = 0;
+	ctx->kinds.len = 0;
+	ctx->syn_err = false;
+	ctx->warn.len = 0;
+	ctx->uses_pushed = 0;
+	ctx->in_rept = false;
+
+	uint64_t key = 0;
+	if (cache_dir != NULL) {
+		if (!readSrc(ctx)) {
+			fprintf(ctx->err, COL_RED "fatal error: " COL_END "failed to read file '%s': %s\n", ctx->src_name, strerror(errno));
+			if (ctx->own_src) {
+				fclose(ctx->src);
+			}
+			return JOB_FATAL;
 		}
 
-		line_no = 1;
-		out_buf.len = 0;
-		lis_buf.len = 0;
-		defs.len = 0;
-		uses.len = 0;
-		while (true) {
-			// Push stripped line into buffer
-			line.len = 0;
+		key = cacheKey(ctx);
 
-			int c;
-			do {
-				c = fgetc(src);
-			} while (c == ' ' || c == '\t');
+		JobStatus status;
+		if (loadFromCache(ctx, key, &status)) {
+			fclose(ctx->src);
+			return status;
+		}
 
-			while (!(c == EOF || c == '\n' || c == ';')) {
-				push(&line, c);
-				c = fgetc(src);
-			}
+		ctx->warn.len = 0;
+	}
 
-			while (line.len > 0 && (line.data[line.len - 1] == ' ' || line.data[line.len - 1] == '\t')) {
-				line.len--;
+	ctx->flushed = 0;
+	if (stream) {
+		setObjName(ctx);
+		ctx->out_fd = creat(ctx->out_name.data, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if (ctx->out_fd < 0) {
+			fprintf(ctx->err, COL_RED "fatal error: " COL_END "failed to create output file '%s': %s\n", ctx->out_name.data, strerror(errno));
+			if (ctx->own_src) {
+				fclose(ctx->src);
 			}
+			return JOB_FATAL;
+		}
+
+		reserve(&ctx->out_buf, STREAM_CHUNK + 4);
+	}
+
+	// Presize buffers from the source size: every word takes at least 4 source bytes
+	struct stat st;
+	if (!stream && fstat(fileno(ctx->src), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size < (1 << 28)) {
+		int size = st.st_size;
+		reserve(&ctx->out_buf, size + 4);
+		reserveArena(&ctx->arena, size);
+		if (!no_lst) {
+			reserve(&ctx->lis_src, size);
+		}
+	}
+
+	PhaseMark read_mark = beginPhase();
+	while (true) {
+		// Push stripped line into buffer
+		ctx->line.len = 0;
+
+		int c;
+		do {
+			c = fgetc(ctx->src);
+		} while (c == ' ' || c == '\t');
 
-			parseLine(line.data, line.len, false);
+		while (!(c == EOF || c == '\n' || c == ';')) {
+			push(&ctx->line, c);
+			c = fgetc(ctx->src);
+		}
+
+		while (ctx->line.len > 0 && (ctx->line.data[ctx->line.len - 1] == ' ' || ctx->line.data[ctx->line.len - 1] == '\t')) {
+			ctx->line.len--;
+		}
+
+		PhaseMark parse_mark = beginPhase();
+		int first_def = ctx->defs.len;
+		if (ctx->in_rept) {
+			reptLine(ctx, ctx->line.data, ctx->line.len);
+		} else {
+			parseLine(ctx, ctx->line.data, ctx->line.len, false);
+		}
+		if (stream) {
+			resolveForward(ctx, first_def);
+		}
+		endPhase(ctx, PHASE_PARSE, parse_mark);
 
-			// Go to next file/line
-			if (c == EOF) {
-				goto eof;
+		if (stream) {
+			if (ctx->out_buf.len >= STREAM_CHUNK && !flushWords(ctx)) {
+				ctx->syn_err = true;
 			}
+		}
 
-			if (c == ';') {
-				while (true) {
-					c = fgetc(src);
-					if (c == EOF) {
-						goto eof;
-					}
+		// Go to next file/line
+		if (c == EOF) {
+			goto eof;
+		}
 
-					if (c == '\n') {
-						break;
-					}
+		if (c == ';') {
+			while (true) {
+				c = fgetc(ctx->src);
+				if (c == EOF) {
+					goto eof;
 				}
-			}
 
-			line_no++;
+				if (c == '\n') {
+					break;
+				}
+			}
 		}
 
+		ctx->line_no++;
+	}
+
 eof:
-		fillLabels();
-		fillLisBuf();
+	// The read phase is what the line loop spent outside parsing and stream flushes
+	endPhase(ctx, PHASE_READ, read_mark);
 
-		if (syn_err) {
-			exit_code = EXIT_FAILURE;
-		} else {
-			out_name.len = 0;
-			while (src_name[out_name.len] != 0 && src_name[out_name.len] != '.') {
-				push(&out_name, src_name[out_name.len]);
+	if (ctx->in_rept) {
+		fprintf(
+			ctx->err,
+			COL_WHITE "%s:%d: " COL_RED "error: " COL_END "'.rept' without '.endr'\n",
+			ctx->src_name,
+			ctx->rept_line
+		);
+		ctx->syn_err = true;
+	}
+	if (time_report) {
+		ctx->phases[PHASE_READ].secs -= ctx->phases[PHASE_PARSE].secs + ctx->phases[PHASE_WRITE].secs;
+		ctx->phases[PHASE_READ].allocs -= ctx->phases[PHASE_PARSE].allocs + ctx->phases[PHASE_WRITE].allocs;
+	}
+
+	JobStatus status = JOB_OK;
+	PhaseMark mark;
+
+	if (stream) {
+		// Only unresolved uses are left, which fillLabels() reports
+		mark = beginPhase();
+		fillLabels(ctx);
+		endPhase(ctx, PHASE_LABELS, mark);
+
+		if (!flushWords(ctx) || close(ctx->out_fd) < 0) {
+			status = JOB_FATAL;
+		}
+
+		if (ctx->syn_err || status != JOB_OK) {
+			unlink(ctx->out_name.data);
+			if (status == JOB_OK) {
+				status = JOB_SYN_ERR;
 			}
-			push(&out_name, '.');
-			push(&out_name, 'o');
+		}
+
+		goto close_src;
+	}
 
-			// Since creat() takes a null terminated string
-			push(&out_name, 0);
-			out_name.len--;
+	if (prof_name != NULL && !ctx->syn_err) {
+		mark = beginPhase();
+		layout(ctx);
+		endPhase(ctx, PHASE_LAYOUT, mark);
+	}
 
-			int out = creat(out_name.data, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-			if (out < 0) {
-				fprintf(stderr, COL_RED "fatal error: " COL_END "failed to create output file '%s': %s\n", out_name.data, strerror(errno));
-				return EXIT_FAILURE;
+	if (opt && !ctx->syn_err) {
+		mark = beginPhase();
+		peephole(ctx);
+		endPhase(ctx, PHASE_PEEPHOLE, mark);
+	}
+
+	mark = beginPhase();
+	fillLabels(ctx);
+	endPhase(ctx, PHASE_LABELS, mark);
+
+	if (!no_lst) {
+		mark = beginPhase();
+		fillLisBuf(ctx);
+		endPhase(ctx, PHASE_LISTING, mark);
+	}
+
+	status = (ctx->syn_err ? JOB_SYN_ERR : JOB_OK);
+
+	if (!ctx->syn_err) {
+		Buf *obj = &ctx->out_buf;
+		if (reloc_out) {
+			fillRoBuf(ctx, &ctx->ro_buf);
+			obj = &ctx->ro_buf;
+		}
+
+		setObjName(ctx);
+		if (!writeOutput(ctx, obj)) {
+			status = JOB_FATAL;
+			goto close_src;
+		}
+
+		if (!no_lst) {
+			setOutName(ctx, ".lst");
+			if (!writeOutput(ctx, &ctx->lis_buf)) {
+				status = JOB_FATAL;
+				goto close_src;
+			}
+		}
+
+		if (cache_dir != NULL) {
+			storeInCache(ctx, key, ".w", &ctx->warn);
+			if (!no_lst) {
+				storeInCache(ctx, key, ".lst", &ctx->lis_buf);
+			}
+			storeInCache(ctx, key, ".o", obj);
+		}
+	}
+
+close_src:
+	if (ctx->own_src && fclose(ctx->src) != 0) {
+		fprintf(ctx->err, COL_RED "fatal error: " COL_END "failed to close file '%s': %s\n", ctx->src_name, strerror(errno));
+		status = JOB_FATAL;
+	}
+
+	if (print_stats) {
+		fprintf(
+			ctx->err,
+			COL_WHITE "%s: " COL_END "stats: %d lines, %d words, %d labels, %d uses, %ld allocations, %d arena bytes\n",
+			ctx->src_name,
+			ctx->line_no,
+			wordIdx(ctx),
+			ctx->defs.len,
+			ctx->uses.len,
+			num_allocs - allocs_start,
+			arenaUsed(&ctx->arena)
+		);
+	}
+
+	if (time_report) {
+		printTimeReport(ctx, &total_mark, status);
+	}
+
+	resetArena(&ctx->arena);
+
+	return status;
+}
+
+void runJob(Ctx *ctx, Job *job)
+{
+	ctx->own_src = (strcmp(job->src_name, "-") != 0);
+	ctx->src_name = (ctx->own_src ? job->src_name : "<stdin>");
+	ctx->err = open_memstream(&job->diag, &job->diag_len);
+	if (ctx->err == NULL) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "open_memstream() failed: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	ctx->report = NULL;
+	if (time_report == REPORT_JSON) {
+		ctx->report = open_memstream(&job->report, &job->report_len);
+		if (ctx->report == NULL) {
+			fprintf(stderr, COL_RED "fatal error: " COL_END "open_memstream() failed: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	job->status = assembleFile(ctx);
+
+	if (fclose(ctx->err) != 0 || ctx->report != NULL && fclose(ctx->report) != 0) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "failed to flush diagnostics: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Prints a finished job's diagnostics; returns false if assembly must stop
+bool reportJob(Job *job, int *exit_code)
+{
+	fwrite(job->diag, 1, job->diag_len, stderr);
+	free(job->diag);
+
+	if (job->report != NULL) {
+		fwrite(job->report, 1, job->report_len, stdout);
+		free(job->report);
+	}
+
+	if (job->status != JOB_OK) {
+		*exit_code = EXIT_FAILURE;
+	}
+
+	return job->status != JOB_FATAL;
+}
+
+Job		*jobs;
+int		num_jobs;
+atomic_int	next_job;
+
+// Set by the first fatal job; like the sequential path, no more jobs are started
+atomic_bool	stop_jobs;
+
+void *worker(void *arg)
+{
+	(void) arg;
+
+	Ctx ctx;
+	initCtx(&ctx);
+
+	while (!atomic_load(&stop_jobs)) {
+		int i = atomic_fetch_add(&next_job, 1);
+		if (i >= num_jobs) {
+			break;
+		}
+
+		runJob(&ctx, &jobs[i]);
+		jobs[i].ran = true;
+		if (jobs[i].status == JOB_FATAL) {
+			atomic_store(&stop_jobs, true);
+		}
+	}
+
+	freeCtx(&ctx);
+	return NULL;
+}
+
+// Reads the text profile written by 'emu -profile'
+bool loadProfile()
+{
+	FILE *file = fopen(prof_name, "r");
+	if (file == NULL) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "failed to open file '%s': %s\n", prof_name, strerror(errno));
+		return false;
+	}
+
+	prof_data = (Buf) {
+		.data	= tryMalloc(INIT_CAP),
+		.cap	= INIT_CAP,
+	};
+
+	int c;
+	while ((c = fgetc(file)) != EOF) {
+		push(&prof_data, c);
+	}
+	fclose(file);
+	push(&prof_data, 0);
+
+	int off;
+	if (sscanf(prof_data.data, "simple-profile %d%n", &prof_words, &off) != 1 || prof_words < 0 || prof_words >= (1 << 24)) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "'%s' is not a profile (see emu -profile)\n", prof_name);
+		return false;
+	}
+
+	prof_count = calloc(prof_words + 1, sizeof (long));
+	if (prof_count == NULL) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "calloc() failed: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	unsigned addr;
+	long count;
+	long taken;
+	int len;
+	while (sscanf(prof_data.data + off, "%x %ld %ld%n", &addr, &count, &taken, &len) == 3) {
+		if (addr >= prof_words) {
+			fprintf(stderr, COL_RED "fatal error: " COL_END "malformed profile '%s': address 0x%08x out of range\n", prof_name, addr);
+			return false;
+		}
+
+		prof_count[addr] = count;
+		off += len;
+	}
+
+	return true;
+}
+
+int parseJobs(char const *str)
+{
+	int num = 0;
+	for (int i = 0; str[i] != 0; i++) {
+		if (!(str[i] >= '0' && str[i] <= '9') || num > 4096) {
+			return -1;
+		}
+
+		num = 10 * num + (str[i] - '0');
+	}
+
+	return num;
+}
+
+int main(int argc, char *argv[])
+{
+	jobs = tryMalloc(argc * sizeof (Job));
+
+	int num_threads = 1;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-j") == 0 || strncmp(argv[i], "-j", 2) == 0 && argv[i][2] != 0) {
+			char const *arg = argv[i] + 2;
+			if (*arg == 0) {
+				if (i + 1 == argc) {
+					fprintf(stderr, COL_RED "fatal error: " COL_END "expected number of jobs after '-j'\n");
+					return EXIT_FAILURE;
+				}
+
+				arg = argv[++i];
 			}
 
-			if (writeAll(out, out_buf.data, out_buf.len) < out_buf.len) {
-				fprintf(stderr, COL_RED "fatal error: " COL_END "failed to write to output file '%s': %s\n", out_name.data, strerror(errno));
+			num_threads = parseJobs(arg);
+			if (num_threads < 1) {
+				fprintf(stderr, COL_RED "fatal error: " COL_END "invalid number of jobs '%s'\n", arg);
 				return EXIT_FAILURE;
 			}
 
-			if (close(out) < 0) {
-				fprintf(stderr, COL_RED "fatal error: " COL_END "failed to close output file '%s': %s\n", out_name.data, strerror(errno));
+			continue;
+		}
+
+		if (strcmp(argv[i], "-no-lst") == 0) {
+			no_lst = true;
+			continue;
+		}
+
+		if (strcmp(argv[i], "-o") == 0) {
+			if (i + 1 == argc) {
+				fprintf(stderr, COL_RED "fatal error: " COL_END "expected file name after '-o'\n");
 				return EXIT_FAILURE;
 			}
 
-			out_name.data[out_name.len - 1] = 'l';
-			push(&out_name, 's');
-			push(&out_name, 't');
-			push(&out_name, 0);
-			out_name.len--;
+			out_path = argv[++i];
+			continue;
+		}
+
+		if (strcmp(argv[i], "-stream") == 0) {
+			stream = true;
+			continue;
+		}
+
+		if (strcmp(argv[i], "-O") == 0) {
+			opt = true;
+			continue;
+		}
 
-			int lis = creat(out_name.data, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-			if (lis < 0) {
-				fprintf(stderr, COL_RED "fatal error: " COL_END "failed to create output file '%s': %s\n", out_name.data, strerror(errno));
+		if (strcmp(argv[i], "-profile") == 0) {
+			if (i + 1 == argc) {
+				fprintf(stderr, COL_RED "fatal error: " COL_END "expected profile after '-profile'\n");
 				return EXIT_FAILURE;
 			}
 
-			if (writeAll(lis, lis_buf.data, lis_buf.len) < lis_buf.len) {
-				fprintf(stderr, COL_RED "fatal error: " COL_END "failed to write to output file '%s': %s\n", out_name.data, strerror(errno));
+			prof_name = argv[++i];
+			continue;
+		}
+
+		if (strcmp(argv[i], "-r") == 0) {
+			reloc_out = true;
+			continue;
+		}
+
+		if (strcmp(argv[i], "-stats") == 0) {
+			print_stats = true;
+			continue;
+		}
+
+		if (strcmp(argv[i], "-time-report") == 0) {
+			time_report = REPORT_TEXT;
+			continue;
+		}
+
+		if (strcmp(argv[i], "-time-report=json") == 0) {
+			time_report = REPORT_JSON;
+			continue;
+		}
+
+		if (strcmp(argv[i], "-cache") == 0) {
+			if (i + 1 == argc) {
+				fprintf(stderr, COL_RED "fatal error: " COL_END "expected directory after '-cache'\n");
 				return EXIT_FAILURE;
 			}
 
-			if (close(lis) < 0) {
-				fprintf(stderr, COL_RED "fatal error: " COL_END "failed to close output file '%.*s': %s\n", out_name.len, out_name.data, strerror(errno));
+			cache_dir = argv[++i];
+			if (mkdir(cache_dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0 && errno != EEXIST) {
+				fprintf(stderr, COL_RED "fatal error: " COL_END "failed to create cache directory '%s': %s\n", cache_dir, strerror(errno));
 				return EXIT_FAILURE;
 			}
+			continue;
+		}
+
+		jobs[num_jobs++] = (Job) { .src_name = argv[i] };
+	}
+
+	if (num_jobs == 0) {
+		fprintf(
+			stderr,
+			COL_RED "fatal error: " COL_END "no input files\n"
+			"usage: %s [-j <jobs>] [-o <output>] [-stream] [-O] [-profile <file>] [-r] [-no-lst] [-stats] [-time-report[=json]] [-cache <dir>] <files>\n",
+			argv[0]
+		);
+		return EXIT_FAILURE;
+	}
+
+	int num_stdin = 0;
+	for (int i = 0; i < num_jobs; i++) {
+		num_stdin += (strcmp(jobs[i].src_name, "-") == 0);
+	}
+
+	if (out_path != NULL && num_jobs > 1) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "'-o' requires a single input file\n");
+		return EXIT_FAILURE;
+	}
+
+	if (num_stdin > 0 && out_path == NULL) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "'-o' is required when reading from stdin ('-')\n");
+		return EXIT_FAILURE;
+	}
+
+	if (stream) {
+		if (opt || prof_name != NULL || reloc_out || cache_dir != NULL) {
+			fprintf(stderr, COL_RED "fatal error: " COL_END "'-stream' cannot be combined with '-O', '-profile', '-r' or '-cache'\n");
+			return EXIT_FAILURE;
+		}
+
+		// The listing needs every word of the image
+		no_lst = true;
+	}
+
+	if (prof_name != NULL) {
+		if (num_jobs > 1) {
+			fprintf(stderr, COL_RED "fatal error: " COL_END "'-profile' requires a single input file\n");
+			return EXIT_FAILURE;
 		}
 
-		if (fclose(src) != 0) {
-			fprintf(stderr, COL_RED "fatal error: " COL_END "failed to close file '%s': %s\n", src_name, strerror(errno));
+		if (!loadProfile()) {
 			return EXIT_FAILURE;
 		}
+	}
+
+	track_kinds = opt || prof_name != NULL;
+
+	int exit_code = EXIT_SUCCESS;
+
+	if (num_threads == 1) {
+		Ctx ctx;
+		initCtx(&ctx);
+
+		for (int i = 0; i < num_jobs; i++) {
+			runJob(&ctx, &jobs[i]);
+			if (!reportJob(&jobs[i], &exit_code)) {
+				return EXIT_FAILURE;
+			}
+		}
+
+		freeCtx(&ctx);
+		free(jobs);
+		return exit_code;
+	}
+
+	if (num_threads > num_jobs) {
+		num_threads = num_jobs;
+	}
 
-		for (int j = 0; j < defs.len; j++) {
-			free(defs.data[j].name);
+	pthread_t *threads = tryMalloc(num_threads * sizeof (pthread_t));
+	for (int i = 0; i < num_threads; i++) {
+		int err = pthread_create(&threads[i], NULL, worker, NULL);
+		if (err != 0) {
+			fprintf(stderr, COL_RED "fatal error: " COL_END "pthread_create() failed: %s\n", strerror(err));
+			return EXIT_FAILURE;
 		}
-		for (int j = 0; j < uses.len; j++) {
-			free(uses.data[j].name);
+	}
+
+	for (int i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	// Jobs already running when one failed fatally have written their outputs,
+	// so the diagnostics of every job that ran are printed
+	bool fatal = false;
+	for (int i = 0; i < num_jobs; i++) {
+		if (jobs[i].ran && !reportJob(&jobs[i], &exit_code)) {
+			fatal = true;
 		}
 	}
 
-	free(line.data);
-	free(out_name.data);
-	free(out_buf.data);
-	free(lis_buf.data);
-	free(defs.data);
-	free(uses.data);
+	if (fatal) {
+		return EXIT_FAILURE;
+	}
+
+	free(threads);
+	free(jobs);
 	return exit_code;
 }
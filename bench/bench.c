@@ -0,0 +1,219 @@
+/*****************************************************************
+*
+*  DECLARATION OF AUTHORSHIP
+*
+*  I hereby declare that this source file is my own unaided work.
+*
+*  Tejas Tanmay Singh
+*  2301AI30
+*
+*****************************************************************/
+
+// Benchmark helper used by run.sh:
+//   bench gen <kind> <n>	writes a generated SIMPLE program to stdout
+//   bench time <cmd...>	runs a command, then prints "<seconds> <peak RSS KiB>" to stderr
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// wait4()
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define COL_RED "\033[1;31m"
+#define COL_END "\033[0m"
+
+// n labels, each referenced once from elsewhere in the program
+void genLabels(int n)
+{
+	printf("\tldc 0\n");
+	for (int i = 0; i < n; i++) {
+		printf("l%d:\tldc l%d\n\tadd\n", i, (int) ((i * 7919L + 1) % n));
+	}
+	printf("\tHALT\n");
+}
+
+// sample/emu decodes every word of the image when loading it and rejects those
+// whose low byte is not an opcode, so generated data keeps that byte at 0, and
+// array lengths are rounded up to a multiple of 256
+int roundLen(int n)
+{
+	return (n + 255) & ~255;
+}
+
+// tests/bubble.asm over n words in descending order
+void genBubble(int n)
+{
+	n = roundLen(n);
+	printf(
+		"\tldc 0\n"
+		"\ta2sp\n"
+		"loopI:\n"
+		"\tldl i\n\tldl len\n\tsub\n\tbrz halt\n"
+		"\tldc 0\n\tstl j\n"
+		"loopJ:\n"
+		"\tldl j\n\tldl len\n\tadc -1\n\tsub\n\tbrz nextI\n"
+		"\tldl j\n\tldnl arr\n\tldl j\n\tadc 1\n\tldnl arr\n\tsub\n\tbrlz nextJ\n"
+		"\tldl j\n\tldnl arr\n\tstl tmp\n"
+		"\tldl j\n\tadc 1\n\tldnl arr\n\tldl j\n\tstnl arr\n"
+		"\tldl tmp\n\tldl j\n\tadc 1\n\tstnl arr\n"
+		"nextJ:\n"
+		"\tldl j\n\tadc 1\n\tstl j\n\tbr loopJ\n"
+		"nextI:\n"
+		"\tldl i\n\tadc 1\n\tstl i\n\tbr loopI\n"
+		"halt:\n"
+		"\tHALT\n"
+		"i:\tdata 0\n"
+		"j:\tdata 0\n"
+		"tmp:\tdata 0\n"
+		"len:\tdata %d\n"
+		"arr:\n",
+		n
+	);
+
+	for (int i = n; i > 0; i--) {
+		printf("\tdata %d\n", i << 8);
+	}
+}
+
+// Recursive fib(n): about fib(n) calls and returns, n stack frames deep
+void genCalls(int n)
+{
+	printf(
+		"\tldc stack\n"
+		"\ta2sp\n"
+		"\tldc %d\n"
+		"\tcall fib\n"
+		"\tldc res\n"
+		"\tstnl 0\n"
+		"\tHALT\n"
+		"; a = return address, b = n; returns fib(n) in a\n"
+		"fib:\n"
+		"\tadj -3\n"
+		"\tstl 0\n"
+		"\tstl 1\n"
+		"\tldc 2\n"
+		"\tsub\n"
+		"\tbrlz base\n"
+		"\tldl 1\n\tadc -1\n\tcall fib\n\tstl 2\n"
+		"\tldl 1\n\tadc -2\n\tcall fib\n"
+		"\tldl 2\n\tadd\n"
+		"\tldl 0\n\tadj 3\n\treturn\n"
+		"base:\n"
+		"\tldl 1\n\tldl 0\n\tadj 3\n\treturn\n"
+		"res:\tdata 0\n",
+		n
+	);
+
+	for (int i = 0; i < 3 * n + 3; i++) {
+		printf("\tdata 0\n");
+	}
+	printf("stack:\tdata 0\n");
+}
+
+// 16 passes adding each index into an n word array (of zeroes)
+void genSweep(int n)
+{
+	n = roundLen(n);
+	printf(
+		"\tldc 0\n"
+		"\ta2sp\n"
+		"pass:\n"
+		"\tldl r\n\tbrz done\n"
+		"\tldl r\n\tadc -1\n\tstl r\n"
+		"\tldc 0\n\tstl i\n"
+		"loop:\n"
+		"\tldl i\n\tldl n\n\tsub\n\tbrz pass\n"
+		"\tldl i\n\tldnl arr\n\tldl i\n\tadd\n\tldl i\n\tstnl arr\n"
+		"\tldl i\n\tadc 1\n\tstl i\n\tbr loop\n"
+		"done:\n"
+		"\tHALT\n"
+		"r:\tdata 16\n"
+		"n:\tdata %d\n"
+		"i:\tdata 0\n"
+		"arr:\n",
+		n
+	);
+
+	for (int i = 0; i < n; i++) {
+		printf("\tdata 0\n");
+	}
+}
+
+typedef struct {
+	char const	*name;
+	void		(*gen)(int n);
+} Gen;
+
+Gen const gens[] = {
+	{ "labels",	genLabels },
+	{ "bubble",	genBubble },
+	{ "calls",	genCalls },
+	{ "sweep",	genSweep },
+};
+
+int timeCmd(char **argv)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "fork() failed: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (pid == 0) {
+		execvp(argv[0], argv);
+		fprintf(stderr, COL_RED "fatal error: " COL_END "failed to run '%s': %s\n", argv[0], strerror(errno));
+		_exit(127);
+	}
+
+	int status;
+	struct rusage usage;
+	if (wait4(pid, &status, 0, &usage) < 0) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "wait4() failed: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "%.6f %ld\n", secs, usage.ru_maxrss);
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc >= 4 && strcmp(argv[1], "gen") == 0) {
+		for (int i = 0; i < sizeof (gens) / sizeof (Gen); i++) {
+			if (strcmp(argv[2], gens[i].name) == 0) {
+				gens[i].gen(atoi(argv[3]));
+				return EXIT_SUCCESS;
+			}
+		}
+
+		fprintf(stderr, COL_RED "fatal error: " COL_END "unknown benchmark '%s'\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	if (argc >= 3 && strcmp(argv[1], "time") == 0) {
+		return timeCmd(argv + 2);
+	}
+
+	fprintf(
+		stderr,
+		COL_RED "fatal error: " COL_END "incorrect usage\n"
+		"usage: %s gen <labels|bubble|calls|sweep> <n>\n"
+		"       %s time <command...>\n",
+		argv[0],
+		argv[0]
+	);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,60 @@
+#!/bin/sh
+# Throughput benchmarks: assembler lines/sec, emulator MIPS and peak RSS of
+# both, with the course sample emulator as a baseline where the image fits it.
+# usage: bench/run.sh [<work dir>]
+
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+out=${1:-${TMPDIR:-/tmp}/simple-bench}
+mkdir -p "$out"
+
+cc -std=c11 -O2 -pthread "$root/asm.c" -o "$out/asm"
+cc -std=c11 -O2 -pthread "$root/emu.c" -o "$out/emu"
+cc -std=c11 -O2 "$root/bench/bench.c" -o "$out/bench"
+
+# The sample emulator has a fixed memory of 10000 words
+SAMPLE_MAX_BYTES=40000
+
+# Runs a command with its output discarded; sets secs and rss (KiB)
+timed() {
+	"$out/bench" time "$@" > /dev/null 2> "$out/time" || {
+		cat "$out/time" >&2
+		return 1
+	}
+	set -- $(tail -n 1 "$out/time")
+	secs=$1
+	rss=$2
+}
+
+printf '%-8s %8s %12s %9s %11s %8s %9s %13s\n' \
+	benchmark lines 'asm lines/s' 'asm KiB' instrs 'emu MIPS' 'emu KiB' 'sample MIPS'
+
+for spec in "labels 100000" "bubble 1000" "calls 25" "sweep 8000"; do
+	set -- $spec
+	name=$1
+	"$out/bench" gen "$1" "$2" > "$out/$name.asm"
+
+	lines=$(wc -l < "$out/$name.asm")
+	timed "$out/asm" -no-lst "$out/$name.asm"
+	asm_rate=$(awk "BEGIN { printf \"%.0f\", $lines / $secs }")
+	asm_rss=$rss
+
+	# Executed instructions are the sum of the per-word counts of a profile
+	instrs=$("$out/emu" -profile "$out/$name.o" | awk 'NR > 1 { n += $2 } END { print n + 0 }')
+
+	timed "$out/emu" -after-bin /dev/null "$out/$name.o"
+	emu_mips=$(awk "BEGIN { printf \"%.1f\", $instrs / $secs / 1e6 }")
+	emu_rss=$rss
+
+	# The sample emulator always prints a trace with -after, so its figure is
+	# dominated by output; it is a floor for comparison, not a like-for-like rate
+	sample_mips=n/a
+	if [ "$(wc -c < "$out/$name.o")" -le $SAMPLE_MAX_BYTES ]; then
+		timed "$root/sample/emu" -after "$out/$name.o"
+		sample_mips=$(awk "BEGIN { printf \"%.2f\", $instrs / $secs / 1e6 }")
+	fi
+
+	printf '%-8s %8d %12s %9s %11s %8s %9s %13s\n' \
+		"$name" "$lines" "$asm_rate" "$asm_rss" "$instrs" "$emu_mips" "$emu_rss" "$sample_mips"
+done
@@ -9,21 +9,163 @@
 *
 *****************************************************************/
 
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// -serve, -client
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// perf_event_open() (-bench)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 
 #define COL_RED "\033[1;31m"
 #define COL_END "\033[0m"
 
+// Static probes (provider 'simple') for bpftrace, perf and SystemTap, laid out
+// as <sys/sdt.h> does: a nop at the probe site plus an ELF note giving its
+// address, its semaphore and where its arguments (all longs) are. Tracers
+// raise the semaphore while attached, and the probes are skipped while it is
+// zero; it is read as volatile so that a run notices a tracer attaching
+// midway. Build with -DNO_PROBES to leave them out entirely.
+#ifndef NO_PROBES
+
+#define PROBE_SEMAPHORE(name) \
+	unsigned short simple_##name##_semaphore __attribute__((section(".probes"), used))
+
+#define PROBE_ENABLED(name) \
+	__builtin_expect(*(volatile unsigned short *) &simple_##name##_semaphore, 0)
+
+#define PROBE_ASM(name, args) \
+	"990:	nop\n" \
+	".pushsection .note.stapsdt, \"?\", \"note\"\n" \
+	".balign 4\n" \
+	".4byte 992f - 991f, 994f - 993f, 3\n" \
+	"991:	.asciz \"stapsdt\"\n" \
+	"992:	.balign 4\n" \
+	"993:	.8byte 990b\n" \
+	".8byte _.stapsdt.base\n" \
+	".8byte simple_" #name "_semaphore\n" \
+	".asciz \"simple\"\n" \
+	".asciz \"" #name "\"\n" \
+	".asciz \"" args "\"\n" \
+	"994:	.balign 4\n" \
+	".popsection\n" \
+	".ifndef _.stapsdt.base\n" \
+	".pushsection .stapsdt.base, \"aG\", \"progbits\", .stapsdt.base, comdat\n" \
+	".weak _.stapsdt.base\n" \
+	".hidden _.stapsdt.base\n" \
+	"_.stapsdt.base: .space 1\n" \
+	".size _.stapsdt.base, 1\n" \
+	".popsection\n" \
+	".endif\n"
+
+#define PROBE2(name, x, y) \
+	do { \
+		if (PROBE_ENABLED(name)) { \
+			__asm__ __volatile__(PROBE_ASM(name, "-8@%[a0] -8@%[a1]") :: [a0] "nor" ((long) (x)), [a1] "nor" ((long) (y))); \
+		} \
+	} while (0)
+
+#define PROBE4(name, x, y, z, w) \
+	do { \
+		if (PROBE_ENABLED(name)) { \
+			__asm__ __volatile__( \
+				PROBE_ASM(name, "-8@%[a0] -8@%[a1] -8@%[a2] -8@%[a3]") \
+				:: [a0] "nor" ((long) (x)), [a1] "nor" ((long) (y)), [a2] "nor" ((long) (z)), [a3] "nor" ((long) (w)) \
+			); \
+		} \
+	} while (0)
+
+// load(words, verified), call/return(core, pc, target, sp), halt(core, pc, a,
+// steps (counted with -limit)) and error(term, pc, 0, 0), where term is a Term below
+PROBE_SEMAPHORE(load);
+PROBE_SEMAPHORE(call);
+PROBE_SEMAPHORE(return);
+PROBE_SEMAPHORE(halt);
+PROBE_SEMAPHORE(error);
+
+#else
+
+#define PROBE2(name, x, y)		do { } while (0)
+#define PROBE4(name, x, y, z, w)	do { } while (0)
+
+#endif
+
+// Modes, indexed by Opt
 char const *const opts[] = {
 	"-trace",
 	"-before",
 	"-after",
+	"-profile",
+	"-batch",
+	"-diff",
+	"-after-bin",
+	"-bench",
+	"-serve",
+	"-debug",
+	"-model",
+	"-verify",
 };
 
+typedef enum {
+	OPT_TRACE,
+	OPT_BEFORE,
+	OPT_AFTER,
+	OPT_PROFILE,
+	OPT_BATCH,
+	OPT_DIFF,
+	OPT_AFTER_BIN,
+	OPT_BENCH,
+	OPT_SERVE,
+	OPT_DEBUG,
+	OPT_MODEL,
+	OPT_VERIFY,
+} Opt;
+
+#define USAGE \
+	"usage: %s [-range <start>:<end>] [-limit <steps>] [-metrics <file>] [-metrics-prom <file>] [-client <socket>] [-cores <n> [-interleave <steps>]] [-io] <option> <file>\n" \
+	"       %s -batch <file> <address> <inputs...>\n" \
+	"       %s [-j <workers>] -serve <socket>\n" \
+	"       %s -debug <file>\n" \
+	"options:\n" \
+	"	-trace	show instruction trace\n" \
+	"	-before	show memory dump before execution\n" \
+	"	-after	show memory dump after execution\n" \
+	"	-diff	show words changed by execution\n" \
+	"	-after-bin <out>	write raw memory image after execution to <out>\n" \
+	"	-bench <runs>	time <runs> executions and report hardware counters\n" \
+	"	-profile	print execution profile (for asm -profile)\n" \
+	"	-verify	check the control flow of the image statically\n" \
+	"	-model <config>	estimate cycles and data cache misses per listing line; <config> is 'default' or\n" \
+	"		<key>=<value>,... with sets, ways, line (words), hit and miss (extra cycles per access),\n" \
+	"		and the cycles of any instruction by mnemonic (1 by default)\n" \
+	"	-batch	run once per input, with its words at <address>, and dump memory after each\n" \
+	"	-range	limit dumps to word addresses [<start>, <end>)\n" \
+	"	-limit	stop with an error after <steps> instructions\n" \
+	"	-metrics	append run metrics to <file> as a JSON line (with -after, -after-bin)\n" \
+	"	-metrics-prom	write run metrics to <file> in Prometheus text format\n" \
+	"	-serve	run jobs sent with -client over the Unix socket <socket>\n" \
+	"	-debug	run under a command prompt with breakpoints and watchpoints ('h' for help)\n" \
+	"	-client	run -trace, -before, -after, -diff or -profile on the server at <socket>\n" \
+	"	-cores	run <n> cores sharing the image, each on its own thread (with -after, -after-bin)\n" \
+	"	-interleave	run the cores in turn on one thread, <steps> at a time, for reproducible runs\n" \
+	"	-io	map the console: ldnl/stnl at 0x7fff00 write a char, 0x7fff01 read one (-1 at end), 0x7fff02 write a number\n"
+
 typedef struct {
 	char	*data;
 	int	cap;
@@ -49,36 +191,444 @@ void push(Buf *buf, char c)
 	buf->len++;
 }
 
-Buf mem = { .cap = 1 };
+// Run state is per thread, so that -serve workers can run jobs side by side
+
+_Thread_local Buf mem = { .cap = 1 };
+
+// Where dumps, traces and profiles go (stdout), and run errors (stderr)
+_Thread_local FILE	*out_file;
+_Thread_local FILE	*err_file;
+
+// Word addresses dumped (-range), clamped to the image
+_Thread_local int	range_start = 0;
+_Thread_local int	range_end = INT_MAX;
+
+// Words stored to since load (-diff), and their values at load
+_Thread_local uint64_t	*dirty;
+_Thread_local int	*orig;
+
+static char const hex_digits[] = "0123456789abcdef";
+
+static inline char *putHex(char *p, unsigned x)
+{
+	for (int i = 7; i >= 0; i--) {
+		p[i] = hex_digits[x & 0xf];
+		x >>= 4;
+	}
+
+	return p + 8;
+}
+
+// Dumps are formatted into this buffer and written out in large chunks
+#define DUMP_BUF_SIZE	(1 << 16)
+
+_Thread_local char	dump_buf[DUMP_BUF_SIZE];
+
+static inline char *flushDump(char *p, int reserve)
+{
+	if (p + reserve <= dump_buf + DUMP_BUF_SIZE) {
+		return p;
+	}
+
+	fwrite(dump_buf, 1, p - dump_buf, out_file);
+	return dump_buf;
+}
+
+void clampRange(int *start, int *end)
+{
+	*end = (range_end < mem.len / 4 ? range_end : mem.len / 4);
+	*start = (range_start < *end ? range_start : *end);
+}
 
 void printMem()
 {
-	printf("(big endian)\n");
+	int start, end;
+	clampRange(&start, &end);
+
+	char *p = dump_buf;
+	p += sprintf(p, "(big endian)\n");
+
+	int i = start;
+	for (; i < end; i++) {
+		// Row address, 4 words, and a newline
+		p = flushDump(p, 10 + 4 * 9);
+
+		if ((i - start) % 4 == 0) {
+			p = putHex(p, i);
+			*p++ = ':';
+			*p++ = ' ';
+		}
+
+		p = putHex(p, *(int *) (mem.data + 4 * i));
+		*p++ = ((i - start) % 4 == 3 ? '\n' : ' ');
+	}
+
+	if ((i - start) % 4 != 0) {
+		*p++ = '\n';
+	}
+
+	fwrite(dump_buf, 1, p - dump_buf, out_file);
+}
+
+// "<address>: <before> -> <after>" for every word whose value changed
+void printDiff()
+{
+	int start, end;
+	clampRange(&start, &end);
+
+	char *p = dump_buf;
+	p += sprintf(p, "(big endian)\n");
+
+	for (int i = start / 64; i < (end + 63) / 64; i++) {
+		uint64_t bits = dirty[i];
+		while (bits != 0) {
+			int w = 64 * i + __builtin_ctzll(bits);
+			bits &= bits - 1;
+
+			int now = *(int *) (mem.data + 4 * w);
+			if (w < start || w >= end || now == orig[w]) {
+				continue;
+			}
+
+			p = flushDump(p, 3 * 9 + 5);
+			p = putHex(p, w);
+			*p++ = ':';
+			*p++ = ' ';
+			p = putHex(p, orig[w]);
+			memcpy(p, " -> ", 4);
+			p += 4;
+			p = putHex(p, now);
+			*p++ = '\n';
+		}
+	}
+
+	fwrite(dump_buf, 1, p - dump_buf, out_file);
+}
+
+// Raw little-endian words, the same format as an object file
+bool writeMem(char const *name)
+{
+	int start, end;
+	clampRange(&start, &end);
+
+	FILE *file = fopen(name, "w");
+	if (file == NULL) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "failed to open file '%s': %s\n", name, strerror(errno));
+		return false;
+	}
+
+	size_t len = 4 * (size_t) (end - start);
+	bool ok = (fwrite(mem.data + 4 * start, 1, len, file) == len);
+	if (fclose(file) != 0) {
+		ok = false;
+	}
+
+	if (!ok) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "failed to write file '%s': %s\n", name, strerror(errno));
+	}
+
+	return ok;
+}
+
+// Execution hooks; exec() instantiates run() once per combination so that
+// the plain run carries no hook checks
+#define HOOK_TRACE	1
+#define HOOK_PROFILE	2
+#define HOOK_DIRTY	4
+#define HOOK_COUNT	8
+#define HOOK_PAGES	16
+#define HOOK_LIMIT	32
+#define HOOK_IO		64
+#define HOOK_WATCH	128
+#define HOOK_MODEL	256
+#define HOOK_UNCHECKED	512
+#define HOOK_BOUNDS	1024
+#define HOOK_BREAK	2048
+
+// Why run() returned
+typedef enum {
+	TERM_HALT,
+	TERM_PC_BOUNDS,
+	TERM_UNKNOWN_INS,
+	TERM_STEP_LIMIT,
+	TERM_WATCH,
+	TERM_MEM_BOUNDS,
+	TERM_BREAK,
+
+	// The HOOK_UNCHECKED run left the verified code; internal, never reported
+	TERM_RECHECK,
+} Term;
+
+char const *const term_names[] = {
+	"halt",
+	"pc_out_of_bounds",
+	"unknown_instruction",
+	"step_limit",
+	"watchpoint",
+	"memory_out_of_bounds",
+	"breakpoint",
+};
+
+// Where run() stopped, and the offending instruction code (TERM_UNKNOWN_INS)
+_Thread_local int	term_pc;
+_Thread_local int	term_ins;
+
+// Core that stopped, for errors of -cores runs (-1 otherwise)
+_Thread_local int	term_core = -1;
+
+// Steps before run() gives up (-limit); limit_hook is HOOK_LIMIT if set
+_Thread_local long	step_limit;
+_Thread_local int	limit_hook;
+
+// Console ports (-io), word addresses outside any image that ldnl and stnl
+// reach with 'ldc 0x7fff00'-style operands: a store to IO_PUTC writes the low
+// byte of b, one to IO_PUTD writes b in decimal, and a load from IO_GETC reads
+// the next byte of stdin (-1 at end of input). io_hook is HOOK_IO if set.
+#define IO_BASE		0x7fff00
+#define IO_PUTC		0x7fff00
+#define IO_GETC		0x7fff01
+#define IO_PUTD		0x7fff02
+#define IO_WORDS	3
+
+_Thread_local int	io_hook;
+
+// HOOK_BOUNDS in -serve workers, whose jobs must not crash the server: loads
+// and stores outside the memory buffer stop the run instead
+_Thread_local int	bounds_hook;
+
+// Console output, written out when full, before reading input, and after a run
+#define IO_BUF_SIZE	(1 << 16)
+
+_Thread_local char	io_buf[IO_BUF_SIZE];
+_Thread_local int	io_len;
+
+void flushIo()
+{
+	fwrite(io_buf, 1, io_len, out_file);
+	io_len = 0;
+}
+
+int ioLoad(int w)
+{
+	if (w != IO_GETC) {
+		return 0;
+	}
+
+	flushIo();
+	fflush(out_file);
+	return getchar();
+}
+
+void ioStore(int w, int val)
+{
+	// Room for a decimal int
+	if (io_len + 12 > IO_BUF_SIZE) {
+		flushIo();
+	}
+
+	if (w == IO_PUTC) {
+		io_buf[io_len++] = val;
+	} else if (w == IO_PUTD) {
+		io_len += sprintf(io_buf + io_len, "%d", val);
+	}
+}
+
+// Words reachable from pc 0 in an image that passed verify(), or NULL if it
+// did not, and the range they span; stores into that range end a
+// HOOK_UNCHECKED run
+_Thread_local unsigned char	*code;
+_Thread_local int		code_lo;
+_Thread_local int		code_hi;
+
+static inline bool inCode(int w)
+{
+	return (unsigned) (w - code_lo) <= (unsigned) (code_hi - code_lo);
+}
+
+// Watched words (-debug, HOOK_WATCH), and the last one stored to and its value
+// before the store (-1 if none since the debugger looked)
+_Thread_local uint64_t	*watch;
+_Thread_local int	watch_hit = -1;
+_Thread_local int	watch_old;
+
+// Words with a breakpoint (-debug, HOOK_BREAK), checked against pc before each
+// fetch so that the program's own loads and stores never see them
+_Thread_local uint64_t	*breaks;
+
+// Cycle model (-model): cycles per opcode, plus hit_cycles or miss_cycles for
+// each data access, looked up in an LRU cache of model_sets sets of
+// model_ways lines of model_line words
+long	op_cycles[256];
+long	hit_cycles = 0;
+long	miss_cycles = 20;
+int	model_sets = 64;
+int	model_ways = 4;
+int	model_line = 8;
+
+// Line tags (-1 if empty) and last use of each way, set by set
+_Thread_local long	*cache_tags;
+_Thread_local long	*cache_used;
+_Thread_local long	cache_clock;
+
+// Per-word cycles, executions, data accesses and misses
+_Thread_local long	*model_cycles;
+_Thread_local long	*model_count;
+_Thread_local long	*model_access;
+_Thread_local long	*model_miss;
+
+// Whether word w is cached; on a miss, its line replaces the least recently used
+static inline bool cacheAccess(int w)
+{
+	long tag = (unsigned) w / model_line;
+	long *tags = cache_tags + tag % model_sets * model_ways;
+	long *used = cache_used + tag % model_sets * model_ways;
+
+	cache_clock++;
+	int victim = 0;
+	for (int i = 0; i < model_ways; i++) {
+		if (tags[i] == tag) {
+			used[i] = cache_clock;
+			return true;
+		}
 
-	int i = 0;
-	for (; i < mem.len / 4; i++) {
-		if (i % 4 == 0) {
-			printf("%08x: ", i);
+		if (used[i] < used[victim]) {
+			victim = i;
 		}
+	}
+
+	tags[victim] = tag;
+	used[victim] = cache_clock;
+	return false;
+}
+
+// Memory pages (of PAGE_WORDS words) fetched from or accessed (-metrics, HOOK_PAGES)
+#define PAGE_WORDS	1024
 
-		printf("%08x%c", *(int *) (mem.data + 4 * i), (i % 4 == 3 ? '\n' : ' '));
+_Thread_local unsigned char	*pages;
+
+// Per-word execution and taken-branch counts (-profile)
+_Thread_local long	*prof_count;
+_Thread_local long	*prof_taken;
+
+// Executions per opcode (-bench)
+_Thread_local long	ins_count[256];
+
+static inline void markDirty(int w)
+{
+	if (w < 0 || w >= mem.len / 4) {
+		return;
+	}
+
+	uint64_t bit = 1ull << (w & 63);
+	if ((dirty[w / 64] & bit) == 0) {
+		dirty[w / 64] |= bit;
+		orig[w] = *(int *) (mem.data + 4 * w);
+	}
+}
+
+static inline void checkWatch(int w)
+{
+	if (w >= 0 && w < mem.len / 4 && (watch[w / 64] >> (w & 63) & 1)) {
+		watch_hit = w;
+		watch_old = *(int *) (mem.data + 4 * w);
 	}
+}
 
-	if (i % 4 != 0) {
-		printf("\n");
+static inline void touch(int w)
+{
+	if (w >= 0 && w < mem.len / 4) {
+		pages[w / PAGE_WORDS] = 1;
 	}
 }
 
-void exec(bool print)
+// Registers of a core. Cores of a -cores run share mem; between the slices of
+// an interleaved run they are resumed from here.
+typedef struct {
+	int	a;
+	int	b;
+	int	pc;
+	int	sp;
+	int	id;
+
+	// Steps taken (HOOK_LIMIT)
+	long	steps;
+} Core;
+
+static inline __attribute__((always_inline)) Term run(int hooks, Core *core)
 {
-	int a = 0;
-	int b = 0;
-	int pc = 0;
-	int sp = 0;
-	while (pc >= 0 && pc < mem.len / 4) {
+	int a = core->a;
+	int b = core->b;
+	int pc = core->pc;
+	int sp = core->sp;
+	long steps = core->steps;
+	Term term;
+
+	// Unchecked runs only fetch verified words, which have known opcodes and
+	// stay in the image wherever they branch to
+	while ((hooks & HOOK_UNCHECKED) || (pc >= 0 && pc < mem.len / 4)) {
+		if ((hooks & HOOK_BREAK) && (breaks[pc / 64] >> (pc & 63) & 1)) {
+			term = TERM_BREAK;
+			goto stop;
+		}
+
+		if (hooks & HOOK_LIMIT) {
+			if (steps == step_limit) {
+				term = TERM_STEP_LIMIT;
+				goto stop;
+			}
+			steps++;
+		}
+
 		int word = *(int *) (mem.data + 4 * pc);
 		int ins = word & 0xff;
 		int op = word >> 8;
+
+		if (hooks & HOOK_PAGES) {
+			pages[pc / PAGE_WORDS] = 1;
+			if (ins >= 2 && ins <= 5) {
+				touch(ins <= 3 ? sp + op : a + op);
+			} else if (ins == 19 || ins == 20) {
+				touch(sp + op);
+			}
+		}
+
+		if (hooks & HOOK_COUNT) {
+			ins_count[ins]++;
+		}
+
+		if ((hooks & HOOK_BOUNDS) && ((ins >= 2 && ins <= 5) || ins == 19 || ins == 20)) {
+			int addr = (ins == 4 || ins == 5 ? a + op : sp + op);
+			bool io = (hooks & HOOK_IO) && (unsigned) (addr - IO_BASE) < IO_WORDS;
+			if (!io && (unsigned) addr >= mem.cap / 4) {
+				term = TERM_MEM_BOUNDS;
+				goto stop;
+			}
+		}
+
+		if (hooks & HOOK_MODEL) {
+			model_count[pc]++;
+			model_cycles[pc] += op_cycles[ins];
+			if ((ins >= 2 && ins <= 5) || ins == 19 || ins == 20) {
+				model_access[pc]++;
+				if (cacheAccess(ins == 4 || ins == 5 ? a + op : sp + op)) {
+					model_cycles[pc] += hit_cycles;
+				} else {
+					model_miss[pc]++;
+					model_cycles[pc] += miss_cycles;
+				}
+			}
+		}
+
+		if (hooks & HOOK_PROFILE) {
+			prof_count[pc]++;
+			if (ins == 13 || ins == 17 || ins == 15 && a == 0 || ins == 16 && a < 0) {
+				prof_taken[pc]++;
+			}
+		}
+
+		// Plain loads and stores are relaxed atomics (ordinary moves on the
+		// host) so that the cores of a -cores run may share words; fadd and cas
+		// are sequentially consistent
 		switch (ins) {
 			case 0:
 				b = a;
@@ -89,17 +639,53 @@ void exec(bool print)
 				break;
 			case 2:
 				b = a;
-				a = *(int *) (mem.data + 4 * (sp + op));
+				a = __atomic_load_n((int *) (mem.data + 4 * (sp + op)), __ATOMIC_RELAXED);
 				break;
 			case 3:
-				*(int *) (mem.data + 4 * (sp + op)) = a;
+				if (hooks & HOOK_DIRTY) {
+					markDirty(sp + op);
+				}
+
+				if (hooks & HOOK_WATCH) {
+					checkWatch(sp + op);
+				}
+
+				__atomic_store_n((int *) (mem.data + 4 * (sp + op)), a, __ATOMIC_RELAXED);
 				a = b;
+				if ((hooks & HOOK_UNCHECKED) && inCode(sp + op)) {
+					pc++;
+					term = TERM_RECHECK;
+					goto stop;
+				}
 				break;
 			case 4:
-				a = *(int *) (mem.data + 4 * (a + op));
+				if ((hooks & HOOK_IO) && (unsigned) (a + op - IO_BASE) < IO_WORDS) {
+					a = ioLoad(a + op);
+					break;
+				}
+
+				a = __atomic_load_n((int *) (mem.data + 4 * (a + op)), __ATOMIC_RELAXED);
 				break;
 			case 5:
-				*(int *) (mem.data + 4 * (a + op)) = b;
+				if ((hooks & HOOK_IO) && (unsigned) (a + op - IO_BASE) < IO_WORDS) {
+					ioStore(a + op, b);
+					break;
+				}
+
+				if (hooks & HOOK_DIRTY) {
+					markDirty(a + op);
+				}
+
+				if (hooks & HOOK_WATCH) {
+					checkWatch(a + op);
+				}
+
+				__atomic_store_n((int *) (mem.data + 4 * (a + op)), b, __ATOMIC_RELAXED);
+				if ((hooks & HOOK_UNCHECKED) && inCode(a + op)) {
+					pc++;
+					term = TERM_RECHECK;
+					goto stop;
+				}
 				break;
 			case 6:
 				a += b;
@@ -125,13 +711,22 @@ void exec(bool print)
 				a = sp;
 				break;
 			case 13:
+				PROBE4(call, core->id, pc, pc + 1 + op, sp);
 				b = a;
 				a = pc;
 				pc += op;
 				break;
 			case 14:
+				PROBE4(return, core->id, pc, a + 1, sp);
 				pc = a;
 				a = b;
+
+				// The one branch whose target is not known statically
+				if ((hooks & HOOK_UNCHECKED) && ((unsigned) pc + 1 >= mem.len / 4 || !code[pc + 1])) {
+					pc++;
+					term = TERM_RECHECK;
+					goto stop;
+				}
 				break;
 			case 15:
 				pc += (a == 0) * op;
@@ -143,16 +738,72 @@ void exec(bool print)
 				pc += op;
 				break;
 			case 18:
-				return;
+				PROBE4(halt, core->id, pc, a, steps);
+				term = TERM_HALT;
+				goto stop;
+			case 19:
+				// fadd: like ldl, and adds the old a to the word
+				if (hooks & HOOK_DIRTY) {
+					markDirty(sp + op);
+				}
+
+				if (hooks & HOOK_WATCH) {
+					checkWatch(sp + op);
+				}
+
+				b = a;
+				a = __atomic_fetch_add((int *) (mem.data + 4 * (sp + op)), b, __ATOMIC_SEQ_CST);
+				if ((hooks & HOOK_UNCHECKED) && inCode(sp + op)) {
+					pc++;
+					term = TERM_RECHECK;
+					goto stop;
+				}
+				break;
+			case 20: {
+				// cas: stores a to the word if it equals b; a = old word
+				if (hooks & HOOK_DIRTY) {
+					markDirty(sp + op);
+				}
+
+				if (hooks & HOOK_WATCH) {
+					checkWatch(sp + op);
+				}
+
+				int old = b;
+				__atomic_compare_exchange_n((int *) (mem.data + 4 * (sp + op)), &old, a, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+				a = old;
+				if ((hooks & HOOK_UNCHECKED) && inCode(sp + op)) {
+					pc++;
+					term = TERM_RECHECK;
+					goto stop;
+				}
+				break;
+			}
+			case 21:
+				// cid: like sp2a, with the core id
+				b = a;
+				a = core->id;
+				break;
 			default:
-				fprintf(stderr, COL_RED "error: " COL_END "unknown instruction with code 0x%02x at pc=0x%08x\n", ins, pc);
-				exit(EXIT_FAILURE);
+				if (hooks & HOOK_UNCHECKED) {
+					__builtin_unreachable();
+				}
+
+				term_ins = ins;
+				term = TERM_UNKNOWN_INS;
+				goto stop;
 		}
 
 		pc++;
 
-		if (print) {
-			printf(
+		if ((hooks & HOOK_WATCH) && watch_hit >= 0) {
+			term = TERM_WATCH;
+			goto stop;
+		}
+
+		if (hooks & HOOK_TRACE) {
+			fprintf(
+				out_file,
 				"a	: %d\n"
 				"b	: %d\n"
 				"pc	: %d\n"
@@ -166,88 +817,2228 @@ void exec(bool print)
 		}
 	}
 
-	fprintf(stderr, COL_RED "error: " COL_END "pc=0x%08x is out of bounds\n", pc);
-	exit(EXIT_FAILURE);
+	term = TERM_PC_BOUNDS;
+
+stop:
+	term_pc = pc;
+	*core = (Core) { a, b, pc, sp, core->id, steps };
+	return term;
 }
 
-int main(int argc, char *argv[])
+#define RUN_CASE(hooks) \
+	case hooks: \
+		return run(hooks, core); \
+	case hooks | HOOK_LIMIT: \
+		return run(hooks | HOOK_LIMIT, core); \
+	case hooks | HOOK_IO: \
+		return run(hooks | HOOK_IO, core); \
+	case hooks | HOOK_IO | HOOK_LIMIT: \
+		return run(hooks | HOOK_IO | HOOK_LIMIT, core);
+
+Term execCore(int hooks, Core *core)
 {
-	if (argc != 3) {
-		fprintf(
-			stderr,
-			COL_RED "fatal error: " COL_END "incorrect usage\n"
-			"usage: %s <option> <file>\n"
-			"options:\n"
-			"	-trace	show instruction trace\n"
-			"	-before	show memory dump before execution\n"
-			"	-after	show memory dump after execution\n",
-			argv[0]
-		);
-		return EXIT_FAILURE;
+	switch (hooks) {
+		RUN_CASE(0)
+		RUN_CASE(HOOK_TRACE)
+		RUN_CASE(HOOK_PROFILE)
+		RUN_CASE(HOOK_DIRTY)
+		RUN_CASE(HOOK_COUNT)
+		RUN_CASE(HOOK_COUNT | HOOK_PAGES)
+		RUN_CASE(HOOK_WATCH)
+		RUN_CASE(HOOK_BREAK)
+		RUN_CASE(HOOK_BREAK | HOOK_WATCH)
+		RUN_CASE(HOOK_MODEL)
+		RUN_CASE(HOOK_UNCHECKED)
+		RUN_CASE(HOOK_BOUNDS)
+		RUN_CASE(HOOK_TRACE | HOOK_BOUNDS)
+		RUN_CASE(HOOK_PROFILE | HOOK_BOUNDS)
+		RUN_CASE(HOOK_DIRTY | HOOK_BOUNDS)
+		RUN_CASE(HOOK_UNCHECKED | HOOK_BOUNDS)
+		default:
+			fprintf(stderr, COL_RED "bug: " COL_END "unsupported hook combination: %d\n", hooks);
+			exit(EXIT_FAILURE);
 	}
+}
 
-	int opt = -1;
-	for (int i = 0; i < sizeof (opts) / sizeof (char *); i++) {
-		if (strcmp(argv[1], opts[i]) == 0) {
-			opt = i;
+// Runs the image on a single core from reset; plain runs of verified images
+// start unchecked and carry on checked if they leave the verified code
+Term exec(int hooks)
+{
+	hooks |= bounds_hook;
+
+	Core core = {0};
+	Term term;
+	if (code != NULL && (hooks & ~(HOOK_LIMIT | HOOK_IO | HOOK_BOUNDS)) == 0) {
+		term = execCore(hooks | HOOK_UNCHECKED, &core);
+		if (term == TERM_RECHECK) {
+			term = execCore(hooks, &core);
+		}
+	} else {
+		term = execCore(hooks, &core);
+	}
+	if (hooks & HOOK_IO) {
+		flushIo();
+	}
+
+	if (term != TERM_HALT) {
+		PROBE4(error, term, term_pc, 0, 0);
+	}
+
+	return term;
+}
+
+// Prints why a run did not halt; returns false in that case
+bool checkTerm(Term term)
+{
+	char where[32] = "";
+	if (term_core >= 0) {
+		snprintf(where, sizeof (where), " on core %d", term_core);
+	}
+
+	switch (term) {
+		case TERM_HALT:
+			return true;
+		case TERM_PC_BOUNDS:
+			fprintf(err_file, COL_RED "error: " COL_END "pc=0x%08x is out of bounds%s\n", term_pc, where);
+			break;
+		case TERM_UNKNOWN_INS:
+			fprintf(err_file, COL_RED "error: " COL_END "unknown instruction with code 0x%02x at pc=0x%08x%s\n", term_ins, term_pc, where);
+			break;
+		case TERM_STEP_LIMIT:
+			fprintf(err_file, COL_RED "error: " COL_END "step limit of %ld reached at pc=0x%08x%s\n", step_limit, term_pc, where);
+			break;
+		case TERM_WATCH:
+			fprintf(err_file, COL_RED "error: " COL_END "stopped by a watchpoint at pc=0x%08x%s\n", term_pc, where);
+			break;
+		case TERM_MEM_BOUNDS:
+			fprintf(err_file, COL_RED "error: " COL_END "memory access out of bounds at pc=0x%08x%s\n", term_pc, where);
+			break;
+		case TERM_BREAK:
+			fprintf(err_file, COL_RED "error: " COL_END "stopped by a breakpoint at pc=0x%08x%s\n", term_pc, where);
+			break;
+		case TERM_RECHECK:
+			fprintf(err_file, COL_RED "bug: " COL_END "unchecked run left the verified code at pc=0x%08x\n", term_pc);
 			break;
+	}
+
+	return false;
+}
+
+// Lanes run in lockstep by -batch: one vector register of 32-bit ints
+// (build with -march=native to get AVX2/AVX-512 widths)
+#if defined(__AVX512F__)
+#define BATCH_LANES	16
+#elif defined(__AVX2__)
+#define BATCH_LANES	8
+#else
+#define BATCH_LANES	4
+#endif
+
+typedef int Vec __attribute__((vector_size(4 * BATCH_LANES)));
+
+#define SPLAT(x)	((Vec) {0} + (x))
+
+// Steps left per lane under -limit; 64-bit since the limit is a long
+typedef long LVec __attribute__((vector_size(8 * BATCH_LANES)));
+
+// Lane memories of a batch, interleaved so that each word is one vector (word
+// w of lane l at lmem[w * BATCH_LANES + l])
+int		*lmem;
+
+// Words that have been stored to, and so may differ between lanes when fetched
+bool		*lstored;
+
+char const	*lane_names[BATCH_LANES];
+bool		lane_failed[BATCH_LANES];
+
+static inline Vec blend(Vec m, Vec x, Vec y)
+{
+	return (x & m) | (y & ~m);
+}
+
+static inline bool anySet(Vec m)
+{
+	for (int l = 0; l < BATCH_LANES; l++) {
+		if (m[l] != 0) {
+			return true;
 		}
 	}
 
-	if (opt < 0) {
-		fprintf(
-			stderr,
-			COL_RED "fatal error: " COL_END "unknown option '%s'\n"
-			"options:\n"
-			"	-trace	show instruction trace\n"
-			"	-before	show memory dump before execution\n"
-			"	-after	show memory dump after execution\n",
-			argv[1]
-		);
-		return EXIT_FAILURE;
+	return false;
+}
+
+static inline bool sameLanes(Vec x, Vec y)
+{
+	for (int l = 0; l < BATCH_LANES; l++) {
+		if (x[l] != y[l]) {
+			return false;
+		}
 	}
 
-	FILE *file = fopen(argv[2], "r");
-	if (file == NULL) {
-		fprintf(stderr, COL_RED "fatal error: " COL_END "failed to open file '%s': %s\n", argv[2], strerror(errno));
-		return EXIT_FAILURE;
+	return true;
+}
+
+// Whether v holds a single value across the lanes of m (returned in val)
+static inline bool uniform(Vec v, Vec m, int *val)
+{
+	int l = 0;
+	while (m[l] == 0) {
+		l++;
 	}
 
-	mem.data = malloc(1);
-	if (mem.data == NULL) {
-		fprintf(stderr, COL_RED "fatal error: " COL_END "malloc() failed: %s\n", strerror(errno));
-		return EXIT_FAILURE;
+	*val = v[l];
+	for (; l < BATCH_LANES; l++) {
+		if (m[l] != 0 && v[l] != *val) {
+			return false;
+		}
 	}
 
-	while (true) {
-		int c = fgetc(file);
-		if (c == EOF) {
-			break;
+	return true;
+}
+
+void failLanes(Vec fail, Vec *m, Vec *live, char const *msg, int pc)
+{
+	for (int l = 0; l < BATCH_LANES; l++) {
+		if (fail[l] != 0) {
+			fprintf(stderr, COL_RED "error: " COL_END "%s: %s at pc=0x%08x\n", lane_names[l], msg, pc);
+			lane_failed[l] = true;
+			(*m)[l] = 0;
+			(*live)[l] = 0;
 		}
+	}
+}
 
-		push(&mem, c);
+// Per-lane load from the lanes of m; lanes with out of bounds addresses fail
+static inline Vec gather(Vec addr, Vec *m, Vec *live, int n, int pc)
+{
+	int w;
+	if (uniform(addr, *m, &w) && w >= 0 && w < n) {
+		return *(Vec *) (lmem + w * BATCH_LANES);
+	}
 
-		for (int i = 0; i < 3; i++) {
-			c = fgetc(file);
-			if (c == EOF) {
-				fprintf(stderr, COL_RED "error: " COL_END "insufficient bytes at word address 0x%08x\n", mem.len / 4);
-				return EXIT_FAILURE;
-			}
+	Vec val = {0};
+	Vec bad = {0};
+	for (int l = 0; l < BATCH_LANES; l++) {
+		if ((*m)[l] == 0) {
+			continue;
+		}
 
-			push(&mem, c);
+		if (addr[l] < 0 || addr[l] >= n) {
+			bad[l] = -1;
+			continue;
 		}
+
+		val[l] = lmem[addr[l] * BATCH_LANES + l];
 	}
 
-	switch (opt) {
-		case 0:
-			exec(true);
-			break;
-		case 1:
-			printMem();
-			break;
-		case 2:
-			exec(false);
-			printMem();
+	if (anySet(bad)) {
+		failLanes(bad, m, live, "memory access out of bounds", pc);
+	}
+
+	return val;
+}
+
+static inline void scatter(Vec addr, Vec val, Vec *m, Vec *live, int n, int pc)
+{
+	int w;
+	if (uniform(addr, *m, &w) && w >= 0 && w < n) {
+		Vec *dst = (Vec *) (lmem + w * BATCH_LANES);
+		*dst = blend(*m, val, *dst);
+		lstored[w] = true;
+		return;
+	}
+
+	Vec bad = {0};
+	for (int l = 0; l < BATCH_LANES; l++) {
+		if ((*m)[l] == 0) {
+			continue;
+		}
+
+		if (addr[l] < 0 || addr[l] >= n) {
+			bad[l] = -1;
+			continue;
+		}
+
+		lmem[addr[l] * BATCH_LANES + l] = val[l];
+		lstored[addr[l]] = true;
+	}
+
+	if (anySet(bad)) {
+		failLanes(bad, m, live, "memory access out of bounds", pc);
+	}
+}
+
+// Runs the first num_lanes lanes of lmem in lockstep. The running group is the
+// set of live lanes at the lowest pc; it splits where lanes disagree on a
+// branch or return target, and others rejoin it when it reaches their pc.
+void execBatch(int num_lanes)
+{
+	int n = mem.len / 4;
+
+	Vec a = {0};
+	Vec b = {0};
+	Vec sp = {0};
+	int pcs[BATCH_LANES] = {0};
+
+	Vec live = {0};
+	for (int l = 0; l < num_lanes; l++) {
+		live[l] = -1;
+	}
+
+	// While every live lane has the same sp (the common case), stack accesses
+	// are whole-vector loads and stores
+	bool sp_same = true;
+	int sp_val = 0;
+
+	LVec left = (LVec) {0} + step_limit;
+	char limit_msg[64];
+	snprintf(limit_msg, sizeof (limit_msg), "step limit of %ld reached", step_limit);
+
+	while (anySet(live)) {
+		int pc = INT_MAX;
+		for (int l = 0; l < BATCH_LANES; l++) {
+			if (live[l] != 0 && pcs[l] < pc) {
+				pc = pcs[l];
+			}
+		}
+
+		Vec m = {0};
+		int wait = INT_MAX;
+		for (int l = 0; l < BATCH_LANES; l++) {
+			if (live[l] == 0) {
+				continue;
+			}
+
+			if (pcs[l] == pc) {
+				m[l] = -1;
+			} else if (pcs[l] < wait) {
+				wait = pcs[l];
+			}
+		}
+
+		while (true) {
+			if (pc == wait) {
+				// Reached lanes waiting here; regroup
+				break;
+			}
+
+			if (limit_hook) {
+				Vec over = m & __builtin_convertvector(left == 0, Vec);
+				if (anySet(over)) {
+					failLanes(over, &m, &live, limit_msg, pc);
+					if (!anySet(m)) {
+						goto regroup;
+					}
+				}
+
+				// m is -1 in running lanes
+				left += __builtin_convertvector(m, LVec);
+			}
+
+			if (pc < 0 || pc >= n) {
+				failLanes(m, &m, &live, "pc out of bounds", pc);
+				break;
+			}
+
+			// Words never stored to are the same in every lane, dead or not
+			Vec row = *(Vec *) (lmem + pc * BATCH_LANES);
+			int word = row[0];
+			if (lstored[pc] && !uniform(row, m, &word)) {
+				// Self-modified code differs between lanes: run the lanes that
+				// agree with the first, the rest wait here
+				Vec agree = (row == SPLAT(word)) & m;
+				for (int l = 0; l < BATCH_LANES; l++) {
+					if (m[l] != 0 && agree[l] == 0) {
+						pcs[l] = pc;
+					}
+				}
+
+				m = agree;
+				wait = pc;
+			}
+
+			int ins = word & 0xff;
+			int op = word >> 8;
+
+			switch (ins) {
+				case 0:
+					b = blend(m, a, b);
+					a = blend(m, SPLAT(op), a);
+					break;
+				case 1:
+					a = blend(m, a + op, a);
+					break;
+				case 2:
+					if (sp_same && sp_val + op >= 0 && sp_val + op < n) {
+						b = blend(m, a, b);
+						a = blend(m, *(Vec *) (lmem + (sp_val + op) * BATCH_LANES), a);
+					} else {
+						Vec val = gather(sp + op, &m, &live, n, pc);
+						b = blend(m, a, b);
+						a = blend(m, val, a);
+					}
+					break;
+				case 3:
+					if (sp_same && sp_val + op >= 0 && sp_val + op < n) {
+						Vec *dst = (Vec *) (lmem + (sp_val + op) * BATCH_LANES);
+						*dst = blend(m, a, *dst);
+						lstored[sp_val + op] = true;
+					} else {
+						scatter(sp + op, a, &m, &live, n, pc);
+					}
+					a = blend(m, b, a);
+					break;
+				case 4:
+					a = blend(m, gather(a + op, &m, &live, n, pc), a);
+					break;
+				case 5:
+					scatter(a + op, b, &m, &live, n, pc);
+					break;
+				case 6:
+					a = blend(m, a + b, a);
+					break;
+				case 7:
+					a = blend(m, b - a, a);
+					break;
+				case 8:
+					// Masked like the scalar shift instructions of the host
+					a = blend(m, b << (a & 31), a);
+					break;
+				case 9:
+					a = blend(m, b >> (a & 31), a);
+					break;
+				case 10:
+					sp = blend(m, sp + op, sp);
+					if (sp_same && sameLanes(m, live)) {
+						sp_val += op;
+					} else {
+						sp_same = false;
+					}
+					break;
+				case 11:
+					sp = blend(m, a, sp);
+					a = blend(m, b, a);
+					sp_same = sameLanes(m, live) && uniform(sp, m, &sp_val);
+					break;
+				case 12:
+					b = blend(m, a, b);
+					a = blend(m, sp, a);
+					break;
+				case 13:
+					b = blend(m, a, b);
+					a = blend(m, SPLAT(pc), a);
+					pc += op;
+					break;
+				case 14: {
+					Vec target = a;
+					a = blend(m, b, a);
+
+					int to;
+					if (uniform(target, m, &to)) {
+						pc = to;
+						break;
+					}
+
+					for (int l = 0; l < BATCH_LANES; l++) {
+						if (m[l] != 0) {
+							pcs[l] = target[l] + 1;
+						}
+					}
+					goto regroup;
+				}
+				case 15:
+				case 16: {
+					Vec taken = (ins == 15 ? a == 0 : a < 0) & m;
+					if (!anySet(taken)) {
+						break;
+					}
+
+					if (sameLanes(taken, m)) {
+						pc += op;
+						break;
+					}
+
+					for (int l = 0; l < BATCH_LANES; l++) {
+						if (m[l] != 0) {
+							pcs[l] = pc + 1 + (taken[l] != 0 ? op : 0);
+						}
+					}
+					goto regroup;
+				}
+				case 17:
+					pc += op;
+					break;
+				case 18:
+					live &= ~m;
+					goto regroup;
+				case 19:
+				case 20: {
+					// Lanes are a single core each, so fadd and cas need no atomicity
+					Vec old = gather(sp + op, &m, &live, n, pc);
+					Vec val = (ins == 19 ? old + a : blend(old == b, a, old));
+					scatter(sp + op, val, &m, &live, n, pc);
+					b = (ins == 19 ? blend(m, a, b) : b);
+					a = blend(m, old, a);
+					break;
+				}
+				case 21:
+					b = blend(m, a, b);
+					a = blend(m, SPLAT(0), a);
+					break;
+				default:
+					failLanes(m, &m, &live, "unknown instruction", pc);
+					goto regroup;
+			}
+
+			if (!anySet(m)) {
+				goto regroup;
+			}
+
+			pc++;
+		}
+
+		for (int l = 0; l < BATCH_LANES; l++) {
+			if (m[l] != 0) {
+				pcs[l] = pc;
+			}
+		}
+
+	regroup:
+		;
+	}
+}
+
+// Reads the words of an input file into the memory of a lane at word address addr
+bool loadInput(char const *name, int addr, int lane)
+{
+	FILE *file = fopen(name, "r");
+	if (file == NULL) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "failed to open file '%s': %s\n", name, strerror(errno));
+		return false;
+	}
+
+	int n = mem.len / 4;
+	int w = addr;
+	unsigned char word[4];
+	size_t got;
+	while ((got = fread(word, 1, 4, file)) == 4) {
+		if (w >= n) {
+			fprintf(stderr, COL_RED "fatal error: " COL_END "input '%s' does not fit in the image at word address 0x%08x\n", name, addr);
+			fclose(file);
+			return false;
+		}
+
+		lmem[w * BATCH_LANES + lane] = word[0] | word[1] << 8 | word[2] << 16 | (unsigned) word[3] << 24;
+		lstored[w] = true;
+		w++;
+	}
+
+	bool ok = (got == 0 && !ferror(file));
+	if (!ok) {
+		fprintf(stderr, COL_RED "error: " COL_END "insufficient bytes at word address 0x%08x of input '%s'\n", w - addr, name);
+	}
+
+	fclose(file);
+	return ok;
+}
+
+// Runs the image once per input, each input's words overlaid at word address
+// addr, BATCH_LANES inputs at a time, and dumps each final memory like -after.
+// Returns false if any run failed.
+bool batch(int addr, char **inputs, int num_inputs)
+{
+	int n = mem.len / 4;
+	if (addr < 0 || addr > n) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "address 0x%08x is outside the image\n", addr);
+		return false;
+	}
+
+	lmem = aligned_alloc(sizeof (Vec), (n + 1) * sizeof (Vec));
+	lstored = malloc(n + 1);
+	if (lmem == NULL || lstored == NULL) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "malloc() failed: %s\n", strerror(errno));
+		return false;
+	}
+
+	bool ok = true;
+	for (int first = 0; first < num_inputs; first += BATCH_LANES) {
+		int num_lanes = (num_inputs - first < BATCH_LANES ? num_inputs - first : BATCH_LANES);
+
+		for (int w = 0; w < n; w++) {
+			*(Vec *) (lmem + w * BATCH_LANES) = SPLAT(*(int *) (mem.data + 4 * w));
+		}
+		memset(lstored, 0, n + 1);
+
+		for (int l = 0; l < num_lanes; l++) {
+			lane_names[l] = inputs[first + l];
+			lane_failed[l] = false;
+			if (!loadInput(inputs[first + l], addr, l)) {
+				free(lmem);
+				free(lstored);
+				return false;
+			}
+		}
+
+		execBatch(num_lanes);
+
+		for (int l = 0; l < num_lanes; l++) {
+			if (lane_failed[l]) {
+				ok = false;
+				continue;
+			}
+
+			Buf image = mem;
+			image.data = malloc(mem.len + 1);
+			if (image.data == NULL) {
+				fprintf(stderr, COL_RED "fatal error: " COL_END "malloc() failed: %s\n", strerror(errno));
+				return false;
+			}
+
+			for (int w = 0; w < n; w++) {
+				*(int *) (image.data + 4 * w) = lmem[w * BATCH_LANES + l];
+			}
+
+			Buf orig = mem;
+			mem = image;
+			fprintf(out_file, "%s:\n", lane_names[l]);
+			printMem();
+			mem = orig;
+			free(image.data);
+		}
+	}
+
+	free(lmem);
+	free(lstored);
+	return ok;
+}
+
+// Text profile read by 'asm -profile': a header with the image size, then
+// "<address> <executions> <taken branches>" for every executed word
+void printProfile()
+{
+	int num_words = mem.len / 4;
+	fprintf(out_file, "simple-profile %d\n", num_words);
+
+	for (int i = 0; i < num_words; i++) {
+		if (prof_count[i] != 0) {
+			fprintf(out_file, "%08x %ld %ld\n", i, prof_count[i], prof_taken[i]);
+		}
+	}
+}
+
+char const *const ins_names[] = {
+	"ldc",
+	"adc",
+	"ldl",
+	"stl",
+	"ldnl",
+	"stnl",
+	"add",
+	"sub",
+	"shl",
+	"shr",
+	"adj",
+	"a2sp",
+	"sp2a",
+	"call",
+	"return",
+	"brz",
+	"brlz",
+	"br",
+	"HALT",
+	"fadd",
+	"cas",
+	"cid",
+};
+
+#define NUM_INS_NAMES	(sizeof (ins_names) / sizeof (char *))
+
+// Host hardware counters read around each run (-bench); fd < 0 if unavailable
+typedef struct {
+	char const	*name;
+	uint64_t	config;
+	int		fd;
+	uint64_t	value;
+} Counter;
+
+Counter counters[] = {
+	{ "cycles",		PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions",	PERF_COUNT_HW_INSTRUCTIONS },
+	{ "branches",		PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+	{ "branch-misses",	PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+#define NUM_COUNTERS	(sizeof (counters) / sizeof (Counter))
+
+void openCounters()
+{
+	for (int i = 0; i < NUM_COUNTERS; i++) {
+		struct perf_event_attr attr = {
+			.type		= PERF_TYPE_HARDWARE,
+			.size		= sizeof (attr),
+			.config		= counters[i].config,
+			.disabled	= 1,
+			.exclude_kernel	= 1,
+			.exclude_hv	= 1,
+		};
+
+		counters[i].fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		counters[i].value = 0;
+	}
+}
+
+void toggleCounters(bool on)
+{
+	for (int i = 0; i < NUM_COUNTERS; i++) {
+		if (counters[i].fd >= 0) {
+			ioctl(counters[i].fd, on ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+		}
+	}
+}
+
+void closeCounters()
+{
+	for (int i = 0; i < NUM_COUNTERS; i++) {
+		if (counters[i].fd < 0) {
+			continue;
+		}
+
+		if (read(counters[i].fd, &counters[i].value, sizeof (uint64_t)) != sizeof (uint64_t)) {
+			counters[i].value = 0;
+		}
+		close(counters[i].fd);
+	}
+}
+
+// Ratio of two counters, or -1 if either is unavailable
+double counterRatio(int num, int den)
+{
+	if (counters[num].fd < 0 || counters[den].fd < 0 || counters[den].value == 0) {
+		return -1;
+	}
+
+	return (double) counters[num].value / counters[den].value;
+}
+
+// Runs the image runs times from a fresh copy. One counting run first gives
+// the instructions per run and the opcode mix, so the timed runs are plain.
+bool bench(int runs)
+{
+	char *image = malloc(mem.len + 1);
+	if (image == NULL) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "malloc() failed: %s\n", strerror(errno));
+		return false;
+	}
+	memcpy(image, mem.data, mem.len);
+
+	if (!checkTerm(exec(HOOK_COUNT | limit_hook))) {
+		free(image);
+		return false;
+	}
+
+	long per_run = 0;
+	for (int i = 0; i < 256; i++) {
+		per_run += ins_count[i];
+	}
+
+	openCounters();
+
+	double secs = 0;
+	for (int i = 0; i < runs; i++) {
+		memcpy(mem.data, image, mem.len);
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		toggleCounters(true);
+		exec(limit_hook);
+		toggleCounters(false);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		secs += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	}
+
+	closeCounters();
+	free(image);
+
+	double total = (double) per_run * runs;
+	printf("runs: %d, %ld instructions per run\n", runs, per_run);
+	printf("time: %.6f s, %.3f ns/instruction, %.1f M instructions/s\n", secs, secs * 1e9 / total, total / secs / 1e6);
+
+	if (counters[0].fd < 0) {
+		printf("hardware counters: unavailable (perf_event_open() not permitted or supported)\n");
+	} else {
+		printf("cycles: %lu, %.2f cycles/instruction\n", counters[0].value, counters[0].value / total);
+
+		double ipc = counterRatio(1, 0);
+		double miss = counterRatio(3, 2);
+		if (ipc >= 0) {
+			printf("host IPC: %.2f\n", ipc);
+		}
+		if (miss >= 0) {
+			printf("branch misses: %.2f%% of %lu branches, %.3f per instruction\n", 100 * miss, counters[2].value, counters[3].value / total);
+		}
+	}
+
+	printf("opcodes:\n");
+	for (int i = 0; i < 256; i++) {
+		if (ins_count[i] != 0) {
+			printf("	%-8s %12ld %6.2f%%\n", ins_names[i], ins_count[i], 100.0 * ins_count[i] / per_run);
+		}
+	}
+
+	return true;
+}
+
+// Per-run metrics (-metrics: JSON lines appended, -metrics-prom: Prometheus text)
+char const	*metrics_name;
+char const	*prom_name;
+
+void printPromLabel(FILE *file, char const *str)
+{
+	for (; *str != 0; str++) {
+		if (*str == '"' || *str == '\\') {
+			fprintf(file, "\\%c", *str);
+		} else if (*str == '\n') {
+			fprintf(file, "\\n");
+		} else {
+			fputc(*str, file);
+		}
+	}
+}
+
+void printJsonString(FILE *file, char const *str)
+{
+	fputc('"', file);
+	for (; *str != 0; str++) {
+		if (*str == '"' || *str == '\\') {
+			fprintf(file, "\\%c", *str);
+		} else if ((unsigned char) *str < 0x20) {
+			fprintf(file, "\\u%04x", *str);
+		} else {
+			fputc(*str, file);
+		}
+	}
+	fputc('"', file);
+}
+
+bool writeMetrics(char const *src_name, Term term, double secs)
+{
+	long steps = 0;
+	for (int i = 0; i < 256; i++) {
+		steps += ins_count[i];
+	}
+
+	int num_pages = (mem.len / 4 + PAGE_WORDS - 1) / PAGE_WORDS;
+	int touched = 0;
+	for (int i = 0; i < num_pages; i++) {
+		touched += pages[i];
+	}
+
+	bool ok = true;
+	if (metrics_name != NULL) {
+		FILE *file = fopen(metrics_name, "a");
+		if (file == NULL) {
+			fprintf(stderr, COL_RED "fatal error: " COL_END "failed to open file '%s': %s\n", metrics_name, strerror(errno));
+			return false;
+		}
+
+		fprintf(file, "{\"file\": ");
+		printJsonString(file, src_name);
+		fprintf(
+			file,
+			", \"reason\": \"%s\", \"pc\": %d, \"steps\": %ld, \"wall_secs\": %.9f, \"words\": %d, \"pages\": %d, \"pages_touched\": %d, \"opcodes\": {",
+			term_names[term],
+			term_pc,
+			steps,
+			secs,
+			mem.len / 4,
+			num_pages,
+			touched
+		);
+
+		bool first = true;
+		for (int i = 0; i < 256; i++) {
+			if (ins_count[i] != 0) {
+				fprintf(file, "%s\"%s\": %ld", first ? "" : ", ", i < NUM_INS_NAMES ? ins_names[i] : "unknown", ins_count[i]);
+				first = false;
+			}
+		}
+		fprintf(file, "}}\n");
+
+		ok = (fclose(file) == 0);
+	}
+
+	if (prom_name != NULL) {
+		FILE *file = fopen(prom_name, "w");
+		if (file == NULL) {
+			fprintf(stderr, COL_RED "fatal error: " COL_END "failed to open file '%s': %s\n", prom_name, strerror(errno));
+			return false;
+		}
+
+		#define PROM_METRIC(name, type, help) \
+			fprintf(file, "# HELP simple_emu_" name " " help "\n# TYPE simple_emu_" name " " type "\n")
+		#define PROM_FILE() \
+			(fprintf(file, "{file=\""), printPromLabel(file, src_name), fprintf(file, "\""))
+
+		PROM_METRIC("steps_total", "counter", "Instructions executed.");
+		fprintf(file, "simple_emu_steps_total");
+		PROM_FILE();
+		fprintf(file, "} %ld\n", steps);
+
+		PROM_METRIC("wall_seconds", "gauge", "Wall time of the run.");
+		fprintf(file, "simple_emu_wall_seconds");
+		PROM_FILE();
+		fprintf(file, "} %.9f\n", secs);
+
+		PROM_METRIC("pages_touched", "gauge", "Memory pages of 1024 words fetched from or accessed.");
+		fprintf(file, "simple_emu_pages_touched");
+		PROM_FILE();
+		fprintf(file, "} %d\n", touched);
+
+		PROM_METRIC("termination", "gauge", "Why the run stopped (1 for the reason that applied).");
+		for (int i = 0; i < sizeof (term_names) / sizeof (char *); i++) {
+			fprintf(file, "simple_emu_termination");
+			PROM_FILE();
+			fprintf(file, ",reason=\"%s\"} %d\n", term_names[i], i == term);
+		}
+
+		PROM_METRIC("opcode_total", "counter", "Instructions executed per opcode.");
+		for (int i = 0; i < 256; i++) {
+			if (ins_count[i] != 0) {
+				fprintf(file, "simple_emu_opcode_total");
+				PROM_FILE();
+				fprintf(file, ",opcode=\"%s\"} %ld\n", i < NUM_INS_NAMES ? ins_names[i] : "unknown", ins_count[i]);
+			}
+		}
+
+		#undef PROM_METRIC
+		#undef PROM_FILE
+
+		ok = (fclose(file) == 0) && ok;
+	}
+
+	if (!ok) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "failed to write metrics: %s\n", strerror(errno));
+	}
+
+	return ok;
+}
+
+// -cores: cores sharing the image, each on its own thread, or taking turns of
+// quantum steps on this one (-interleave), so that runs are reproducible
+int	num_cores;
+long	quantum;
+
+typedef struct {
+	Core	core;
+
+	// Run state of the main thread, for the core's thread
+	Buf	mem;
+	long	step_limit;
+	int	limit_hook;
+
+	Term	term;
+	int	term_pc;
+	int	term_ins;
+	bool	done;
+} CoreJob;
+
+void *coreThread(void *arg)
+{
+	CoreJob *job = arg;
+	mem = job->mem;
+	step_limit = job->step_limit;
+	limit_hook = job->limit_hook;
+
+	job->term = execCore(limit_hook, &job->core);
+	job->term_pc = term_pc;
+	job->term_ins = term_ins;
+	return NULL;
+}
+
+// Round robin over the cores that have not stopped, until none is left
+void interleave(CoreJob *jobs)
+{
+	long user_limit = step_limit;
+	int running = num_cores;
+	while (running > 0) {
+		for (int i = 0; i < num_cores; i++) {
+			if (jobs[i].done) {
+				continue;
+			}
+
+			Core *core = &jobs[i].core;
+			step_limit = core->steps + quantum;
+			if (limit_hook && user_limit < step_limit) {
+				step_limit = user_limit;
+			}
+
+			Term term = execCore(HOOK_LIMIT | io_hook, core);
+			if (term == TERM_STEP_LIMIT && !(limit_hook && core->steps == user_limit)) {
+				continue;
+			}
+
+			jobs[i].term = term;
+			jobs[i].term_pc = term_pc;
+			jobs[i].term_ins = term_ins;
+			jobs[i].done = true;
+			running--;
+		}
+	}
+
+	step_limit = user_limit;
+	if (io_hook) {
+		flushIo();
+	}
+}
+
+// Runs num_cores cores from reset (core i with id i) until all have stopped;
+// returns false (after reporting why) if any did not halt
+bool runCores()
+{
+	CoreJob *jobs = calloc(num_cores, sizeof (CoreJob));
+	pthread_t *threads = calloc(num_cores, sizeof (pthread_t));
+	if (jobs == NULL || threads == NULL) {
+		fprintf(err_file, COL_RED "fatal error: " COL_END "calloc() failed: %s\n", strerror(errno));
+		free(jobs);
+		free(threads);
+		return false;
+	}
+
+	for (int i = 0; i < num_cores; i++) {
+		jobs[i].core.id = i;
+		jobs[i].mem = mem;
+		jobs[i].step_limit = step_limit;
+		jobs[i].limit_hook = limit_hook;
+	}
+
+	if (quantum > 0) {
+		interleave(jobs);
+	} else {
+		for (int i = 0; i < num_cores; i++) {
+			int err = pthread_create(&threads[i], NULL, coreThread, &jobs[i]);
+			if (err != 0) {
+				fprintf(err_file, COL_RED "fatal error: " COL_END "pthread_create() failed: %s\n", strerror(err));
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		for (int i = 0; i < num_cores; i++) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+
+	bool ok = true;
+	for (int i = 0; i < num_cores; i++) {
+		term_core = i;
+		term_pc = jobs[i].term_pc;
+		term_ins = jobs[i].term_ins;
+		ok = checkTerm(jobs[i].term) && ok;
+	}
+	term_core = -1;
+
+	free(jobs);
+	free(threads);
+	return ok;
+}
+
+// Runs the image for a mode, recording metrics if requested; returns false
+// (after reporting why) if it did not halt
+bool runImage(char const *src_name, int hooks)
+{
+	if (num_cores > 0) {
+		return runCores();
+	}
+
+	if (metrics_name == NULL && prom_name == NULL) {
+		return checkTerm(exec(hooks | limit_hook | io_hook));
+	}
+
+	pages = calloc(mem.len / 4 / PAGE_WORDS + 1, 1);
+	if (pages == NULL) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "calloc() failed: %s\n", strerror(errno));
+		return false;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	Term term = exec(hooks | HOOK_COUNT | HOOK_PAGES | limit_hook | io_hook);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	bool ok = writeMetrics(src_name, term, secs);
+	free(pages);
+
+	return checkTerm(term) && ok;
+}
+
+// Parses "<start>:<end>" word addresses
+bool parseRange(char const *arg)
+{
+	char *end;
+	long start = strtol(arg, &end, 0);
+	if (end == arg || *end != ':' || start < 0 || start > INT_MAX) {
+		return false;
+	}
+
+	char const *rest = end + 1;
+	long stop = strtol(rest, &end, 0);
+	if (end == rest || *end != '\0' || stop < start || stop > INT_MAX) {
+		return false;
+	}
+
+	range_start = start;
+	range_end = stop;
+	return true;
+}
+
+// Follows the control flow of opcodes 13 to 18 from pc 0, requiring every
+// reachable word to have a known opcode and every branch target and
+// fall-through to stay in the image; a call is assumed to return to the word
+// after it, the only one return is checked against at run time. Sets code
+// (and its range) if the image passes, and reports each problem to report if
+// not NULL. Returns the number of reachable words, or -1 if the image fails.
+int verify(FILE *report)
+{
+	free(code);
+	code = NULL;
+
+	int n = mem.len / 4;
+	unsigned char *seen = calloc(n + 1, 1);
+	int *todo = malloc((n + 1) * sizeof (int));
+	if (seen == NULL || todo == NULL) {
+		free(seen);
+		free(todo);
+		return -1;
+	}
+
+	int num_todo = 0;
+	int num_seen = 0;
+	int errors = 0;
+	code_lo = INT_MAX;
+	code_hi = -1;
+	if (n > 0) {
+		seen[0] = 1;
+		todo[num_todo++] = 0;
+	}
+
+	while (num_todo > 0) {
+		int pc = todo[--num_todo];
+		int word = *(int *) (mem.data + 4 * pc);
+		int ins = word & 0xff;
+		int op = word >> 8;
+
+		num_seen++;
+		code_lo = (pc < code_lo ? pc : code_lo);
+		code_hi = (pc > code_hi ? pc : code_hi);
+
+		if (ins >= NUM_INS_NAMES) {
+			if (report != NULL) {
+				fprintf(report, COL_RED "error: " COL_END "unknown instruction with code 0x%02x at pc=0x%08x\n", ins, pc);
+			}
+			errors++;
+			continue;
+		}
+
+		long next[2];
+		char const *what[2];
+		int num_next = 0;
+		if (ins != 14 && ins != 17 && ins != 18) {
+			what[num_next] = "fall-through";
+			next[num_next++] = pc + 1L;
+		}
+		if (ins == 13 || (ins >= 15 && ins <= 17)) {
+			what[num_next] = "branch target";
+			next[num_next++] = pc + 1L + op;
+		}
+
+		for (int i = 0; i < num_next; i++) {
+			if (next[i] < 0 || next[i] >= n) {
+				if (report != NULL) {
+					fprintf(report, COL_RED "error: " COL_END "%s of pc=0x%08x leaves the image\n", what[i], pc);
+				}
+				errors++;
+				continue;
+			}
+
+			if (!seen[next[i]]) {
+				seen[next[i]] = 1;
+				todo[num_todo++] = next[i];
+			}
+		}
+	}
+
+	free(todo);
+	if (errors > 0) {
+		free(seen);
+		return -1;
+	}
+
+	code = seen;
+	return num_seen;
+}
+
+// Reads an object file into mem
+bool loadImage(FILE *file)
+{
+	if (mem.data == NULL) {
+		mem.data = malloc(mem.cap);
+		if (mem.data == NULL) {
+			fprintf(err_file, COL_RED "fatal error: " COL_END "malloc() failed: %s\n", strerror(errno));
+			return false;
+		}
+	}
+
+	mem.len = 0;
+	while (true) {
+		int c = getc(file);
+		if (c == EOF) {
+			break;
+		}
+
+		push(&mem, c);
+
+		for (int i = 0; i < 3; i++) {
+			c = getc(file);
+			if (c == EOF) {
+				fprintf(err_file, COL_RED "error: " COL_END "insufficient bytes at word address 0x%08x\n", mem.len / 4);
+				return false;
+			}
+
+			push(&mem, c);
+		}
+	}
+
+	// Words past the image read as 0, whatever an earlier -serve job left there
+	memset(mem.data + mem.len, 0, mem.cap - mem.len);
+
+	verify(NULL);
+	PROBE2(load, mem.len / 4, code != NULL);
+	return true;
+}
+
+// The modes that only need the image; used directly and by -serve
+bool runMode(Opt opt, char const *src_name)
+{
+	switch (opt) {
+		case OPT_TRACE:
+			return checkTerm(exec(HOOK_TRACE | limit_hook | io_hook));
+		case OPT_BEFORE:
+			printMem();
+			return true;
+		case OPT_AFTER:
+			if (!runImage(src_name, 0)) {
+				return false;
+			}
+			printMem();
+			return true;
+		case OPT_PROFILE: {
+			prof_count = calloc(mem.len / 4 + 1, sizeof (long));
+			prof_taken = calloc(mem.len / 4 + 1, sizeof (long));
+			if (prof_count == NULL || prof_taken == NULL) {
+				fprintf(err_file, COL_RED "fatal error: " COL_END "calloc() failed: %s\n", strerror(errno));
+				free(prof_count);
+				free(prof_taken);
+				return false;
+			}
+
+			bool ok = checkTerm(exec(HOOK_PROFILE | limit_hook | io_hook));
+			if (ok) {
+				printProfile();
+			}
+			free(prof_count);
+			free(prof_taken);
+			return ok;
+		}
+		case OPT_DIFF: {
+			// orig is only written for dirty words, so untouched pages stay unmapped
+			dirty = calloc(mem.len / 4 / 64 + 1, sizeof (uint64_t));
+			orig = calloc(mem.len / 4 + 1, sizeof (int));
+			if (dirty == NULL || orig == NULL) {
+				fprintf(err_file, COL_RED "fatal error: " COL_END "calloc() failed: %s\n", strerror(errno));
+				free(dirty);
+				free(orig);
+				return false;
+			}
+
+			bool ok = checkTerm(exec(HOOK_DIRTY | limit_hook | io_hook));
+			if (ok) {
+				printDiff();
+			}
+			free(dirty);
+			free(orig);
+			return ok;
+		}
+		default:
+			fprintf(err_file, COL_RED "bug: " COL_END "unimplemented option: idx: %d\n", opt);
+			return false;
+	}
+}
+
+bool isServeMode(Opt opt)
+{
+	return opt == OPT_TRACE || opt == OPT_BEFORE || opt == OPT_AFTER || opt == OPT_DIFF || opt == OPT_PROFILE;
+}
+
+// -debug. Breakpoints are the fetches checked by the HOOK_BREAK
+// instantiations and watchpoints the stores checked by the HOOK_WATCH ones,
+// so memory always holds the program's own words.
+int	num_breaks;
+int	num_watches;
+
+// Labels from the listing next to the image, if any
+typedef struct {
+	char	*name;
+	int	addr;
+} DebugLabel;
+
+DebugLabel	*dbg_labels;
+int		num_dbg_labels;
+
+// The listing of an image: its name with '.lst' for its extension; NULL if missing
+FILE *openListing(char const *src_name)
+{
+	char const *base = strrchr(src_name, '/');
+	char const *dot = strrchr(base != NULL ? base : src_name, '.');
+	int len = (dot != NULL ? dot - src_name : strlen(src_name));
+
+	char *lst_name = malloc(len + 5);
+	if (lst_name == NULL) {
+		return NULL;
+	}
+	sprintf(lst_name, "%.*s.lst", len, src_name);
+
+	FILE *file = fopen(lst_name, "r");
+	free(lst_name);
+	return file;
+}
+
+// Reads the "<address>          <label>:" lines of the listing
+void loadLabels(char const *src_name)
+{
+	FILE *file = openListing(src_name);
+	if (file == NULL) {
+		return;
+	}
+
+	char line[256];
+	int cap = 0;
+	while (fgets(line, sizeof (line), file) != NULL) {
+		unsigned addr;
+		char name[128];
+		int name_len;
+		if (sscanf(line, "%8x %127s", &addr, name) != 2 || (name_len = strlen(name)) < 2 || name[name_len - 1] != ':') {
+			continue;
+		}
+
+		if (num_dbg_labels == cap) {
+			cap = (cap == 0 ? 64 : 2 * cap);
+			DebugLabel *labels = realloc(dbg_labels, cap * sizeof (DebugLabel));
+			if (labels == NULL) {
+				break;
+			}
+			dbg_labels = labels;
+		}
+
+		name[name_len - 1] = 0;
+		dbg_labels[num_dbg_labels++] = (DebugLabel) { strdup(name), addr };
+	}
+
+	fclose(file);
+}
+
+char const *labelAt(int addr)
+{
+	for (int i = 0; i < num_dbg_labels; i++) {
+		if (dbg_labels[i].addr == addr) {
+			return dbg_labels[i].name;
+		}
+	}
+
+	return NULL;
+}
+
+// A label or a number; -1 if neither
+int parseAddr(char const *arg)
+{
+	for (int i = 0; i < num_dbg_labels; i++) {
+		if (strcmp(dbg_labels[i].name, arg) == 0) {
+			return dbg_labels[i].addr;
+		}
+	}
+
+	char *end;
+	long addr = strtol(arg, &end, 0);
+	return (*arg != 0 && *end == 0 && addr >= 0 && addr <= INT_MAX ? addr : -1);
+}
+
+void printWhere(char const *what, int addr)
+{
+	char const *label = labelAt(addr);
+	fprintf(out_file, "%s 0x%08x%s%s%s", what, addr, label != NULL ? " (" : "", label != NULL ? label : "", label != NULL ? ")" : "");
+}
+
+// Runs the core for up to n steps (all if n < 0), first stepping over a
+// breakpoint at its pc
+Term resume(Core *core, long n)
+{
+	int hooks = HOOK_LIMIT | (num_watches > 0 ? HOOK_WATCH : 0);
+	if (breaks[core->pc / 64] >> (core->pc & 63) & 1) {
+		step_limit = core->steps + 1;
+		Term term = execCore(hooks, core);
+		if (term != TERM_STEP_LIMIT || --n == 0) {
+			return term;
+		}
+	}
+
+	step_limit = (n < 0 ? LONG_MAX : core->steps + n);
+	return execCore(hooks | (num_breaks > 0 ? HOOK_BREAK : 0), core);
+}
+
+// Reports why the core stopped; returns false once it cannot run any further
+bool reportStop(Core *core, Term term)
+{
+	switch (term) {
+		case TERM_STEP_LIMIT:
+			printWhere("pc", core->pc);
+			fprintf(out_file, "\n");
+			return true;
+		case TERM_BREAK:
+			printWhere("breakpoint at pc", core->pc);
+			fprintf(out_file, "\n");
+			return true;
+		case TERM_WATCH:
+			printWhere("watchpoint on word", watch_hit);
+			fprintf(out_file, ": %d -> %d, ", watch_old, *(int *) (mem.data + 4 * watch_hit));
+			printWhere("stored at pc", core->pc - 1);
+			fprintf(out_file, "\n");
+			watch_hit = -1;
+			return true;
+		case TERM_HALT:
+			printWhere("halted at pc", core->pc);
+			fprintf(out_file, "\n");
+			return false;
+		default:
+			break;
+	}
+
+	fflush(out_file);
+	checkTerm(term);
+	return false;
+}
+
+#define DEBUG_HELP \
+	"commands:\n" \
+	"	b <addr>	set a breakpoint (address or label)\n" \
+	"	d <addr>	delete a breakpoint\n" \
+	"	w <addr>	watch a word for stores\n" \
+	"	u <addr>	stop watching a word\n" \
+	"	c	continue\n" \
+	"	s [<n>]	step one or <n> instructions\n" \
+	"	r	show registers\n" \
+	"	x <addr> [<n>]	show one or <n> words\n" \
+	"	q	quit\n"
+
+// Reads commands from stdin until 'q' or its end; returns false if the
+// program stopped with an error
+bool debug(char const *src_name)
+{
+	loadLabels(src_name);
+
+	int n = mem.len / 4;
+	watch = calloc(n / 64 + 1, sizeof (uint64_t));
+	breaks = calloc(n / 64 + 1, sizeof (uint64_t));
+	if (watch == NULL || breaks == NULL) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "malloc() failed: %s\n", strerror(errno));
+		return false;
+	}
+
+	Core core = {0};
+	bool running = true;
+	bool ok = true;
+	char *line = NULL;
+	size_t cap = 0;
+	while (fprintf(out_file, "(emu) "), fflush(out_file), getline(&line, &cap, stdin) >= 0) {
+		char cmd[16] = "";
+		char arg1[128] = "";
+		char arg2[128] = "";
+		int num_args = sscanf(line, "%15s %127s %127s", cmd, arg1, arg2);
+		if (num_args <= 0) {
+			continue;
+		}
+
+		int addr = (num_args >= 2 ? parseAddr(arg1) : -1);
+		bool needs_addr = (strchr("bdwux", cmd[0]) != NULL && cmd[1] == 0);
+		if (needs_addr && (addr < 0 || addr >= n)) {
+			fprintf(out_file, "expected an address or label in the image\n");
+			continue;
+		}
+
+		if (strcmp(cmd, "b") == 0 || strcmp(cmd, "d") == 0) {
+			if (cmd[0] == 'b' && code != NULL && !code[addr]) {
+				fprintf(out_file, "warning: 0x%08x is not reachable code, so the breakpoint may never be hit\n", addr);
+			}
+
+			uint64_t bit = 1ull << (addr & 63);
+			bool set = (breaks[addr / 64] & bit) != 0;
+			if (cmd[0] == 'b' && !set) {
+				breaks[addr / 64] |= bit;
+				num_breaks++;
+			} else if (cmd[0] == 'd' && set) {
+				breaks[addr / 64] &= ~bit;
+				num_breaks--;
+			}
+		} else if (strcmp(cmd, "w") == 0 || strcmp(cmd, "u") == 0) {
+			uint64_t bit = 1ull << (addr & 63);
+			bool set = (watch[addr / 64] & bit) != 0;
+			if (cmd[0] == 'w' && !set) {
+				watch[addr / 64] |= bit;
+				num_watches++;
+			} else if (cmd[0] == 'u' && set) {
+				watch[addr / 64] &= ~bit;
+				num_watches--;
+			}
+		} else if (strcmp(cmd, "c") == 0 || strcmp(cmd, "s") == 0) {
+			long steps = (cmd[0] == 'c' ? -1 : 1);
+			if (cmd[0] == 's' && num_args >= 2 && (steps = strtol(arg1, NULL, 0)) <= 0) {
+				fprintf(out_file, "expected a number of steps\n");
+				continue;
+			}
+
+			if (!running) {
+				fprintf(out_file, "the program has stopped\n");
+				continue;
+			}
+
+			Term term = resume(&core, steps);
+			running = reportStop(&core, term);
+			ok = (running || term == TERM_HALT);
+		} else if (strcmp(cmd, "r") == 0) {
+			fprintf(out_file, "a	: %d\nb	: %d\npc	: %d\nsp	: %d\n", core.a, core.b, core.pc, core.sp);
+		} else if (strcmp(cmd, "x") == 0) {
+			long count = (num_args >= 3 ? strtol(arg2, NULL, 0) : 1);
+			for (long i = addr; i < addr + count && i < n; i++) {
+				fprintf(out_file, "%08lx: %08x\n", i, *(int *) (mem.data + 4 * i));
+			}
+		} else if (strcmp(cmd, "q") == 0) {
+			break;
+		} else {
+			fprintf(out_file, DEBUG_HELP);
+		}
+	}
+
+	free(line);
+	free(watch);
+	free(breaks);
+	return ok;
+}
+
+// Parses the <key>=<value>,... of -model (or 'default')
+bool parseModel(char *spec)
+{
+	for (int i = 0; i < NUM_INS_NAMES; i++) {
+		op_cycles[i] = 1;
+	}
+
+	if (strcmp(spec, "default") == 0) {
+		return true;
+	}
+
+	for (char *item = strtok(spec, ","); item != NULL; item = strtok(NULL, ",")) {
+		char *eq = strchr(item, '=');
+		if (eq == NULL) {
+			return false;
+		}
+		*eq = 0;
+
+		char *end;
+		long val = strtol(eq + 1, &end, 0);
+		if (eq[1] == 0 || *end != 0 || val < 0 || val > INT_MAX) {
+			return false;
+		}
+
+		long *cost = NULL;
+		for (int i = 0; i < NUM_INS_NAMES; i++) {
+			if (strcmp(item, ins_names[i]) == 0) {
+				cost = &op_cycles[i];
+			}
+		}
+
+		if (cost != NULL) {
+			*cost = val;
+		} else if (strcmp(item, "hit") == 0) {
+			hit_cycles = val;
+		} else if (strcmp(item, "miss") == 0) {
+			miss_cycles = val;
+		} else if (strcmp(item, "sets") == 0 && val > 0) {
+			model_sets = val;
+		} else if (strcmp(item, "ways") == 0 && val > 0 && val <= 64) {
+			model_ways = val;
+		} else if (strcmp(item, "line") == 0 && val > 0) {
+			model_line = val;
+		} else {
+			return false;
+		}
+	}
+
+	return (long) model_sets * model_ways <= (1 << 24);
+}
+
+// Totals, then a row per executed word, annotated with its listing line if
+// the listing is next to the image
+void printModel(char const *src_name)
+{
+	int n = mem.len / 4;
+	char **lines = calloc(n + 1, sizeof (char *));
+	FILE *file = openListing(src_name);
+	if (lines != NULL && file != NULL) {
+		char line[256];
+		while (fgets(line, sizeof (line), file) != NULL) {
+			unsigned addr, word;
+			if (sscanf(line, "%8x %8x", &addr, &word) == 2 && addr < n) {
+				line[strcspn(line, "\n")] = 0;
+				free(lines[addr]);
+				lines[addr] = strdup(line + 18);
+			}
+		}
+	}
+	if (file != NULL) {
+		fclose(file);
+	}
+
+	long cycles = 0, count = 0, accesses = 0, misses = 0;
+	for (int i = 0; i < n; i++) {
+		cycles += model_cycles[i];
+		count += model_count[i];
+		accesses += model_access[i];
+		misses += model_miss[i];
+	}
+
+	fprintf(out_file, "cache: %d sets x %d ways x %d words, %ld cycles per hit, %ld per miss\n", model_sets, model_ways, model_line, hit_cycles, miss_cycles);
+	fprintf(out_file, "cycles: %ld, instructions: %ld, %.3f cycles/instruction\n", cycles, count, count != 0 ? (double) cycles / count : 0);
+	fprintf(out_file, "data accesses: %ld, hits: %ld (%.2f%%), misses: %ld\n", accesses, accesses - misses, accesses != 0 ? 100.0 * (accesses - misses) / accesses : 0, misses);
+	fprintf(out_file, "address       cycles      count   accesses     misses    hit%%  line\n");
+
+	for (int i = 0; i < n; i++) {
+		if (model_count[i] == 0) {
+			continue;
+		}
+
+		fprintf(out_file, "%08x %11ld %10ld %10ld %10ld ", i, model_cycles[i], model_count[i], model_access[i], model_miss[i]);
+		if (model_access[i] != 0) {
+			fprintf(out_file, "%7.2f", 100.0 * (model_access[i] - model_miss[i]) / model_access[i]);
+		} else {
+			fprintf(out_file, "%7s", "-");
+		}
+		fprintf(out_file, "  %s\n", lines != NULL && lines[i] != NULL ? lines[i] : "");
+	}
+
+	if (lines != NULL) {
+		for (int i = 0; i < n; i++) {
+			free(lines[i]);
+		}
+		free(lines);
+	}
+}
+
+// Runs the image under the cycle model and prints its report
+bool model(char const *src_name)
+{
+	int n = mem.len / 4;
+	long ways = (long) model_sets * model_ways;
+	cache_tags = malloc(ways * sizeof (long));
+	cache_used = calloc(ways, sizeof (long));
+	model_cycles = calloc(n + 1, sizeof (long));
+	model_count = calloc(n + 1, sizeof (long));
+	model_access = calloc(n + 1, sizeof (long));
+	model_miss = calloc(n + 1, sizeof (long));
+
+	bool ok = (cache_tags != NULL && cache_used != NULL && model_cycles != NULL && model_count != NULL && model_access != NULL && model_miss != NULL);
+	if (!ok) {
+		fprintf(err_file, COL_RED "fatal error: " COL_END "calloc() failed: %s\n", strerror(errno));
+	} else {
+		for (long i = 0; i < ways; i++) {
+			cache_tags[i] = -1;
+		}
+
+		ok = checkTerm(exec(HOOK_MODEL | limit_hook | io_hook));
+		if (ok) {
+			printModel(src_name);
+		}
+	}
+
+	free(cache_tags);
+	free(cache_used);
+	free(model_cycles);
+	free(model_count);
+	free(model_access);
+	free(model_miss);
+	return ok;
+}
+
+// -serve protocol. A request is the line
+//   "SIMPLE-EMU 1 <option> <step limit or -1> <range start> <range end> <path>\n"
+// where a path of '-' means the object bytes follow until the client shuts
+// down its side. The response is "<exit status> <error bytes> <output bytes>\n"
+// followed by the error text and the output.
+#define SERVE_MAGIC	"SIMPLE-EMU 1"
+
+// Initial memory of each -serve worker; it is kept across jobs, and cleared
+// past the image by loadImage()
+#define SERVE_MEM_INIT	(1 << 20)
+
+int writeAll(int fd, char const *data, size_t len)
+{
+	size_t tot_written = 0;
+	while (tot_written < len) {
+		ssize_t written = write(fd, data + tot_written, len - tot_written);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		tot_written += written;
+	}
+
+	return 0;
+}
+
+bool serveJob(FILE *in)
+{
+	char *line = NULL;
+	size_t cap = 0;
+	if (getline(&line, &cap, in) < 0) {
+		fprintf(err_file, COL_RED "fatal error: " COL_END "missing request\n");
+		free(line);
+		return false;
+	}
+
+	char name[32];
+	long limit;
+	int start, end;
+	int off = 0;
+	if (sscanf(line, SERVE_MAGIC " %31s %ld %d %d %n", name, &limit, &start, &end, &off) != 4 || off == 0) {
+		fprintf(err_file, COL_RED "fatal error: " COL_END "malformed request\n");
+		free(line);
+		return false;
+	}
+
+	char *path = line + off;
+	path[strcspn(path, "\n")] = 0;
+
+	int opt = -1;
+	for (int i = 0; i < sizeof (opts) / sizeof (char *); i++) {
+		if (strcmp(name, opts[i]) == 0) {
+			opt = i;
+			break;
+		}
+	}
+
+	if (opt < 0 || !isServeMode(opt)) {
+		fprintf(err_file, COL_RED "fatal error: " COL_END "option '%s' is not supported by the server\n", name);
+		free(line);
+		return false;
+	}
+
+	range_start = (start >= 0 ? start : 0);
+	range_end = end;
+	limit_hook = (limit >= 0 ? HOOK_LIMIT : 0);
+	step_limit = limit;
+
+	bool ok;
+	if (strcmp(path, "-") == 0) {
+		ok = loadImage(in);
+	} else {
+		FILE *file = fopen(path, "r");
+		if (file == NULL) {
+			fprintf(err_file, COL_RED "fatal error: " COL_END "failed to open file '%s': %s\n", path, strerror(errno));
+			free(line);
+			return false;
+		}
+
+		ok = loadImage(file);
+		fclose(file);
+	}
+
+	ok = ok && runMode(opt, strcmp(path, "-") == 0 ? "<socket>" : path);
+	free(line);
+	return ok;
+}
+
+void serveConn(int fd)
+{
+	FILE *in = fdopen(fd, "r");
+	if (in == NULL) {
+		close(fd);
+		return;
+	}
+
+	char *out_data = NULL;
+	char *err_data = NULL;
+	size_t out_len = 0;
+	size_t err_len = 0;
+	out_file = open_memstream(&out_data, &out_len);
+	err_file = open_memstream(&err_data, &err_len);
+	if (out_file == NULL || err_file == NULL) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "open_memstream() failed: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	bool ok = serveJob(in);
+
+	fclose(out_file);
+	fclose(err_file);
+
+	char hdr[64];
+	int hdr_len = snprintf(hdr, sizeof (hdr), "%d %zu %zu\n", ok ? EXIT_SUCCESS : EXIT_FAILURE, err_len, out_len);
+
+	// A client that went away is not the server's problem
+	if (writeAll(fd, hdr, hdr_len) == 0 && writeAll(fd, err_data, err_len) == 0) {
+		writeAll(fd, out_data, out_len);
+	}
+
+	free(out_data);
+	free(err_data);
+	fclose(in);
+}
+
+void *serveWorker(void *arg)
+{
+	int listen_fd = *(int *) arg;
+
+	mem.cap = SERVE_MEM_INIT;
+	mem.data = malloc(mem.cap);
+	bounds_hook = HOOK_BOUNDS;
+	if (mem.data == NULL) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "malloc() failed: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	while (true) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EINTR && errno != ECONNABORTED) {
+				fprintf(stderr, COL_RED "error: " COL_END "accept() failed: %s\n", strerror(errno));
+			}
+			continue;
+		}
+
+		serveConn(fd);
+	}
+
+	return NULL;
+}
+
+bool setSockAddr(struct sockaddr_un *addr, char const *name)
+{
+	*addr = (struct sockaddr_un) { .sun_family = AF_UNIX };
+	if (strlen(name) >= sizeof (addr->sun_path)) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "socket path '%s' is too long\n", name);
+		return false;
+	}
+
+	strcpy(addr->sun_path, name);
+	return true;
+}
+
+int serve(char const *name, int num_workers)
+{
+	struct sockaddr_un addr;
+	if (!setSockAddr(&addr, name)) {
+		return EXIT_FAILURE;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "socket() failed: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	// Replace a socket left behind by a server that is no longer running
+	struct stat st;
+	if (lstat(name, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (probe >= 0 && connect(probe, (struct sockaddr *) &addr, sizeof (addr)) < 0 && errno == ECONNREFUSED) {
+			unlink(name);
+		}
+		close(probe);
+	}
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "failed to listen on '%s': %s\n", name, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	for (int i = 1; i < num_workers; i++) {
+		pthread_t thread;
+		int err = pthread_create(&thread, NULL, serveWorker, &fd);
+		if (err != 0) {
+			fprintf(stderr, COL_RED "fatal error: " COL_END "pthread_create() failed: %s\n", strerror(err));
+			return EXIT_FAILURE;
+		}
+	}
+
+	serveWorker(&fd);
+	return EXIT_SUCCESS;
+}
+
+// Sends a job to a -serve server and relays its response; returns the exit status
+int runClient(char const *name, Opt opt, char const *file_name)
+{
+	struct sockaddr_un addr;
+	if (!setSockAddr(&addr, name)) {
+		return EXIT_FAILURE;
+	}
+
+	FILE *file = fopen(file_name, "r");
+	if (file == NULL) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "failed to open file '%s': %s\n", file_name, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof (addr)) < 0) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "failed to connect to '%s': %s\n", name, strerror(errno));
+		fclose(file);
+		return EXIT_FAILURE;
+	}
+
+	char buf[1 << 16];
+	int len = snprintf(buf, sizeof (buf), SERVE_MAGIC " %s %ld %d %d -\n", opts[opt], limit_hook ? step_limit : -1, range_start, range_end);
+	bool ok = (writeAll(fd, buf, len) == 0);
+
+	size_t got;
+	while (ok && (got = fread(buf, 1, sizeof (buf), file)) > 0) {
+		ok = (writeAll(fd, buf, got) == 0);
+	}
+	ok = ok && !ferror(file);
+	fclose(file);
+
+	FILE *in = (ok && shutdown(fd, SHUT_WR) == 0 ? fdopen(fd, "r") : NULL);
+	int status;
+	size_t err_len, out_len;
+	if (in == NULL || fscanf(in, "%d %zu %zu", &status, &err_len, &out_len) != 3 || getc(in) != '\n') {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "no response from '%s'\n", name);
+		return EXIT_FAILURE;
+	}
+
+	for (size_t i = 0; i < err_len + out_len; i += got) {
+		size_t want = err_len + out_len - i;
+		if (i < err_len && want > err_len - i) {
+			want = err_len - i;
+		}
+
+		got = fread(buf, 1, want < sizeof (buf) ? want : sizeof (buf), in);
+		if (got == 0) {
+			fprintf(stderr, COL_RED "fatal error: " COL_END "truncated response from '%s'\n", name);
+			return EXIT_FAILURE;
+		}
+
+		fwrite(buf, 1, got, i < err_len ? stderr : stdout);
+	}
+
+	fclose(in);
+	return status;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt = -1;
+	char const *bin_name = NULL;
+	long bench_runs = 0;
+	char const *sock_name = NULL;
+	char const *client_name = NULL;
+	long num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+	out_file = stdout;
+	err_file = stderr;
+
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-limit") == 0) {
+			char *end;
+			if (i + 1 < argc) {
+				step_limit = strtol(argv[i + 1], &end, 0);
+			}
+
+			if (i + 1 == argc || *end != '\0' || step_limit < 0) {
+				fprintf(stderr, COL_RED "fatal error: " COL_END "expected number of steps after '-limit'\n");
+				return EXIT_FAILURE;
+			}
+
+			limit_hook = HOOK_LIMIT;
+			i++;
+			continue;
+		}
+
+		if (strcmp(argv[i], "-metrics") == 0 || strcmp(argv[i], "-metrics-prom") == 0) {
+			if (i + 1 == argc) {
+				fprintf(stderr, COL_RED "fatal error: " COL_END "expected file name after '%s'\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+
+			if (strcmp(argv[i], "-metrics") == 0) {
+				metrics_name = argv[i + 1];
+			} else {
+				prom_name = argv[i + 1];
+			}
+
+			i++;
+			continue;
+		}
+
+		if (strcmp(argv[i], "-client") == 0) {
+			if (i + 1 == argc) {
+				fprintf(stderr, COL_RED "fatal error: " COL_END "expected socket path after '-client'\n");
+				return EXIT_FAILURE;
+			}
+
+			client_name = argv[++i];
+			continue;
+		}
+
+		if (strcmp(argv[i], "-j") == 0) {
+			char *end;
+			if (i + 1 < argc) {
+				num_workers = strtol(argv[i + 1], &end, 0);
+			}
+
+			if (i + 1 == argc || *end != '\0' || num_workers <= 0 || num_workers > 4096) {
+				fprintf(stderr, COL_RED "fatal error: " COL_END "expected number of workers after '-j'\n");
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			continue;
+		}
+
+		if (strcmp(argv[i], "-cores") == 0 || strcmp(argv[i], "-interleave") == 0) {
+			bool cores = (strcmp(argv[i], "-cores") == 0);
+			char *end;
+			long val = 0;
+			if (i + 1 < argc) {
+				val = strtol(argv[i + 1], &end, 0);
+			}
+
+			if (i + 1 == argc || *end != '\0' || val <= 0 || (cores && val > 4096)) {
+				fprintf(stderr, COL_RED "fatal error: " COL_END "expected number of %s after '%s'\n", cores ? "cores" : "steps", argv[i]);
+				return EXIT_FAILURE;
+			}
+
+			if (cores) {
+				num_cores = val;
+			} else {
+				quantum = val;
+			}
+
+			i++;
+			continue;
+		}
+
+		if (strcmp(argv[i], "-io") == 0) {
+			io_hook = HOOK_IO;
+			continue;
+		}
+
+		if (strcmp(argv[i], "-range") == 0) {
+			if (i + 1 == argc || !parseRange(argv[i + 1])) {
+				fprintf(stderr, COL_RED "fatal error: " COL_END "expected <start>:<end> after '-range'\n");
+				return EXIT_FAILURE;
+			}
+
+			i++;
+			continue;
+		}
+
+		int found = -1;
+		for (int j = 0; j < sizeof (opts) / sizeof (char *); j++) {
+			if (strcmp(argv[i], opts[j]) == 0) {
+				found = j;
+				break;
+			}
+		}
+
+		if (found < 0) {
+			fprintf(stderr, COL_RED "fatal error: " COL_END "unknown option '%s'\n" USAGE, argv[i], argv[0], argv[0], argv[0], argv[0]);
+			return EXIT_FAILURE;
+		}
+
+		if (opt >= 0) {
+			fprintf(stderr, COL_RED "fatal error: " COL_END "options '%s' and '%s' cannot be combined\n", opts[opt], opts[found]);
+			return EXIT_FAILURE;
+		}
+
+		opt = found;
+		if (opt == OPT_AFTER_BIN) {
+			if (i + 1 == argc) {
+				fprintf(stderr, COL_RED "fatal error: " COL_END "expected file name after '-after-bin'\n");
+				return EXIT_FAILURE;
+			}
+
+			bin_name = argv[++i];
+		}
+
+		if (opt == OPT_SERVE) {
+			if (i + 1 == argc) {
+				fprintf(stderr, COL_RED "fatal error: " COL_END "expected socket path after '-serve'\n");
+				return EXIT_FAILURE;
+			}
+
+			sock_name = argv[++i];
+		}
+
+		if (opt == OPT_MODEL) {
+			if (i + 1 == argc || !parseModel(argv[i + 1])) {
+				fprintf(stderr, COL_RED "fatal error: " COL_END "expected 'default' or <key>=<value>,... after '-model'\n");
+				return EXIT_FAILURE;
+			}
+
+			i++;
+		}
+
+		if (opt == OPT_BENCH) {
+			char *end;
+			if (i + 1 < argc) {
+				bench_runs = strtol(argv[i + 1], &end, 0);
+			}
+
+			if (i + 1 == argc || *end != '\0' || bench_runs <= 0 || bench_runs > INT_MAX) {
+				fprintf(stderr, COL_RED "fatal error: " COL_END "expected number of runs after '-bench'\n");
+				return EXIT_FAILURE;
+			}
+
+			i++;
+		}
+	}
+
+	// Positional arguments: the object file, then the address and inputs of -batch
+	char **args = argv + i;
+	int num_args = argc - i;
+	if (opt < 0 || (opt == OPT_BATCH ? num_args < 3 : num_args != (opt == OPT_SERVE ? 0 : 1))) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "incorrect usage\n" USAGE, argv[0], argv[0], argv[0], argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if ((metrics_name != NULL || prom_name != NULL) && opt != OPT_AFTER && opt != OPT_AFTER_BIN) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "metrics are only recorded with '-after' and '-after-bin'\n");
+		return EXIT_FAILURE;
+	}
+
+	if (quantum > 0 && num_cores == 0) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "'-interleave' needs '-cores'\n");
+		return EXIT_FAILURE;
+	}
+
+	if (num_cores > 0 && ((opt != OPT_AFTER && opt != OPT_AFTER_BIN) || client_name != NULL || metrics_name != NULL || prom_name != NULL)) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "'-cores' only supports -after and -after-bin, without -client or metrics\n");
+		return EXIT_FAILURE;
+	}
+
+	if (opt == OPT_DEBUG && limit_hook) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "'-debug' steps under its own control, without '-limit'\n");
+		return EXIT_FAILURE;
+	}
+
+	if (io_hook && (opt == OPT_BATCH || opt == OPT_BENCH || opt == OPT_DEBUG || opt == OPT_SERVE || client_name != NULL || (num_cores > 0 && quantum == 0))) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "'-io' is not supported with -batch, -bench, -debug, -serve, -client or threaded -cores\n");
+		return EXIT_FAILURE;
+	}
+
+	if (opt == OPT_SERVE) {
+		if (client_name != NULL || limit_hook || metrics_name != NULL || prom_name != NULL || num_cores > 0) {
+			fprintf(stderr, COL_RED "fatal error: " COL_END "'-serve' takes its options from each job\n");
+			return EXIT_FAILURE;
+		}
+
+		return serve(sock_name, num_workers);
+	}
+
+	if (client_name != NULL) {
+		if (!isServeMode(opt) || metrics_name != NULL || prom_name != NULL) {
+			fprintf(stderr, COL_RED "fatal error: " COL_END "'-client' supports -trace, -before, -after, -diff and -profile\n");
+			return EXIT_FAILURE;
+		}
+
+		return runClient(client_name, opt, args[0]);
+	}
+
+	FILE *file = fopen(args[0], "r");
+	if (file == NULL) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "failed to open file '%s': %s\n", args[0], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (!loadImage(file)) {
+		return EXIT_FAILURE;
+	}
+
+	switch (opt) {
+		case OPT_TRACE:
+		case OPT_BEFORE:
+		case OPT_AFTER:
+		case OPT_PROFILE:
+		case OPT_DIFF:
+			if (!runMode(opt, args[0])) {
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_BATCH: {
+			char *end;
+			long addr = strtol(args[1], &end, 0);
+			if (*args[1] == '\0' || *end != '\0' || addr < 0 || addr > INT_MAX) {
+				fprintf(stderr, COL_RED "fatal error: " COL_END "invalid address '%s'\n", args[1]);
+				return EXIT_FAILURE;
+			}
+
+			if (!batch(addr, args + 2, num_args - 2)) {
+				free(mem.data);
+				fclose(file);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+		case OPT_AFTER_BIN:
+			if (!runImage(args[0], 0) || !writeMem(bin_name)) {
+				free(mem.data);
+				fclose(file);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_VERIFY: {
+			int num_words = verify(stderr);
+			if (num_words < 0) {
+				free(mem.data);
+				fclose(file);
+				return EXIT_FAILURE;
+			}
+
+			printf("verified: %d reachable words in 0x%08x..0x%08x\n", num_words, code_lo, code_hi);
+			break;
+		}
+		case OPT_MODEL:
+			if (!model(args[0])) {
+				free(mem.data);
+				fclose(file);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_DEBUG:
+			if (!debug(args[0])) {
+				free(mem.data);
+				fclose(file);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_BENCH:
+			if (!bench(bench_runs)) {
+				free(mem.data);
+				fclose(file);
+				return EXIT_FAILURE;
+			}
 			break;
 		default:
 			fprintf(stderr, COL_RED "bug: " COL_END "unimplemented option: idx: %d\n", opt);
@@ -256,7 +3047,7 @@ int main(int argc, char *argv[])
 
 	free(mem.data);
 	if (fclose(file) != 0) {
-		fprintf(stderr, COL_RED "fatal error: " COL_END "failed to close file '%s': %s\n", argv[2], strerror(errno));
+		fprintf(stderr, COL_RED "fatal error: " COL_END "failed to close file '%s': %s\n", args[0], strerror(errno));
 		return EXIT_FAILURE;
 	}
 	return EXIT_SUCCESS;
@@ -0,0 +1,832 @@
+/*****************************************************************
+*
+*  DECLARATION OF AUTHORSHIP
+*
+*  I hereby declare that this source file is my own unaided work.
+*
+*  Tejas Tanmay Singh
+*  2301AI30
+*
+*****************************************************************/
+
+// Differential tester used by run.sh: assembles random SIMPLE programs with
+// our asm and sample/asm, runs them on our emu (through -serve) and
+// sample/emu, and compares the object words, the traces and the memory after
+// each run. Divergent programs are minimized and kept.
+//   fuzz <asm> <emu> <sample asm> <sample emu> [-n <cases>] [-j <threads>] [-seed <seed>] [-out <dir>]
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define COL_RED "\033[1;31m"
+#define COL_END "\033[0m"
+
+// Programs are made of items: straight-line snippets that keep every access
+// inside the image (so that both emulators see the same memory) and forward
+// branches (so that every program halts). A minimized program is the
+// original with as many items removed as still diverges.
+#define MAX_MAIN	48
+#define NUM_SUBS	3
+#define MAX_SUB		8
+#define MAX_ITEMS	(MAX_MAIN + NUM_SUBS * MAX_SUB)
+#define DATA_WORDS	16
+
+// Programs assembled by one spawn of our asm
+#define BATCH		32
+
+// Seconds before a tool is assumed hung
+#define SPAWN_TIMEOUT	5
+
+typedef struct {
+	char	text[64];
+
+	// Branches: the item their label goes before (text is the mnemonic)
+	int	target;
+
+	// Subroutine the item is in, -1 for the main program
+	int	sub;
+} Item;
+
+typedef struct {
+	uint64_t	seed;
+	// Main program items come first
+	int		num_main;
+	int		num_items;
+	Item		items[MAX_ITEMS];
+	bool		removed[MAX_ITEMS];
+	int		data[DATA_WORDS];
+} Case;
+
+char const	*asm_path;
+char const	*emu_path;
+char const	*sample_asm_path;
+char const	*sample_emu_path;
+char const	*out_dir;
+char		sock_path[108];
+
+long		num_cases = 1000;
+long		next_case;
+uint64_t	base_seed;
+int		num_diverged;
+pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t next(uint64_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static int pick(uint64_t *state, int n)
+{
+	return next(state) % n;
+}
+
+// A 24-bit operand in one of the notations both assemblers accept (the
+// sample assembler rejects hex digits above 9 and signs on hex)
+void printOperand(char *buf, int size, uint64_t *state)
+{
+	int val = pick(state, 4) == 0 ? pick(state, 1 << 24) - (1 << 23) : pick(state, 64) - 16;
+	switch (pick(state, 4)) {
+		case 0: {
+			// Hex made of the digits 0-9 only
+			int hex = 0;
+			for (int i = pick(state, 6) + 1; i > 0; i--) {
+				hex = 16 * hex + pick(state, 10);
+			}
+			snprintf(buf, size, "0x%x", hex);
+			break;
+		}
+		case 1:
+			snprintf(buf, size, "0%o", val & 0x7fff);
+			break;
+		default:
+			snprintf(buf, size, "%d", val);
+			break;
+	}
+}
+
+// Straight-line snippet; sub selects the offsets of the subroutine frame
+void genSnippet(char *buf, int size, uint64_t *state, bool sub)
+{
+	char op[32];
+	printOperand(op, sizeof (op), state);
+	int slot = (sub ? 1 + pick(state, 9) : pick(state, 8));
+
+	switch (pick(state, 12)) {
+		case 0:
+			snprintf(buf, size, "\tldc %s\n", op);
+			break;
+		case 1:
+			snprintf(buf, size, "\tadc %s\n", op);
+			break;
+		case 2:
+			snprintf(buf, size, "\tldl %d\n", slot);
+			break;
+		case 3:
+			snprintf(buf, size, "\tstl %d\n", slot);
+			break;
+		case 4:
+			snprintf(buf, size, "\tldc arr\n\tldnl %d\n", pick(state, DATA_WORDS));
+			break;
+		case 5:
+			snprintf(buf, size, "\tldc arr\n\tstnl %d\n", pick(state, DATA_WORDS));
+			break;
+		case 6:
+			snprintf(buf, size, "\tadd\n");
+			break;
+		case 7:
+			snprintf(buf, size, "\tsub\n");
+			break;
+		case 8:
+			snprintf(buf, size, "\tldc %d\n\t%s\n", pick(state, 32), pick(state, 2) ? "shl" : "shr");
+			break;
+		case 9:
+			snprintf(buf, size, "\tsp2a\n");
+			break;
+		case 10:
+			snprintf(buf, size, "\tldc %s\n\tldl %d\n", op, slot);
+			break;
+		default:
+			snprintf(buf, size, "\tldc %s\n\tstl %d\n", op, slot);
+			break;
+	}
+}
+
+void genCase(Case *c, uint64_t seed)
+{
+	memset(c, 0, sizeof (Case));
+	c->seed = seed;
+
+	uint64_t state = seed * 0x9e3779b97f4a7c15 | 1;
+	c->num_main = 1 + pick(&state, MAX_MAIN);
+	for (int i = 0; i < c->num_main; i++) {
+		Item *item = &c->items[i];
+		item->target = -1;
+		item->sub = -1;
+
+		int kind = pick(&state, 8);
+		if (kind == 0) {
+			static char const *const brs[] = { "brz", "brlz", "br" };
+			strcpy(item->text, brs[pick(&state, 3)]);
+			item->target = i + 1 + pick(&state, c->num_main - i);
+		} else if (kind == 1) {
+			snprintf(item->text, sizeof (item->text), "\tcall sub%d\n", pick(&state, NUM_SUBS));
+		} else {
+			genSnippet(item->text, sizeof (item->text), &state, false);
+		}
+	}
+
+	c->num_items = c->num_main;
+	for (int s = 0; s < NUM_SUBS; s++) {
+		for (int i = pick(&state, MAX_SUB + 1); i > 0; i--) {
+			Item *item = &c->items[c->num_items++];
+			item->target = -1;
+			item->sub = s;
+			genSnippet(item->text, sizeof (item->text), &state, true);
+		}
+	}
+
+	for (int i = 0; i < DATA_WORDS; i++) {
+		c->data[i] = pick(&state, 1 << 24) - (1 << 23);
+	}
+}
+
+bool writeCase(Case const *c, char const *path)
+{
+	FILE *file = fopen(path, "w");
+	if (file == NULL) {
+		return false;
+	}
+
+	fprintf(file, "; fuzz case %llu\n\tldc stack\n\ta2sp\n", (unsigned long long) c->seed);
+
+	bool placed[MAX_MAIN] = { false };
+	for (int i = 0; i <= c->num_main; i++) {
+		if (i < c->num_main && c->removed[i]) {
+			continue;
+		}
+
+		// Labels of branches to here or to removed items before here
+		for (int j = 0; j < i; j++) {
+			if (!c->removed[j] && c->items[j].target >= 0 && c->items[j].target <= i && !placed[j]) {
+				fprintf(file, "L%d:\n", j);
+				placed[j] = true;
+			}
+		}
+
+		if (i == c->num_main) {
+			break;
+		}
+
+		Item const *item = &c->items[i];
+		if (item->target >= 0) {
+			fprintf(file, "\t%s L%d\n", item->text, i);
+		} else {
+			fputs(item->text, file);
+		}
+	}
+
+	fprintf(file, "\tHALT\n");
+	// Subroutines keep the return address at sp + 0 of a two word frame
+	for (int s = 0; s < NUM_SUBS; s++) {
+		fprintf(file, "sub%d:\n\tadj -2\n\tstl 0\n", s);
+		for (int i = c->num_main; i < c->num_items; i++) {
+			if (c->items[i].sub == s && !c->removed[i]) {
+				fputs(c->items[i].text, file);
+			}
+		}
+		fprintf(file, "\tldl 0\n\tadj 2\n\treturn\n");
+	}
+
+	fprintf(file, "arr:\n");
+	for (int i = 0; i < DATA_WORDS; i++) {
+		fprintf(file, "\tdata %d\n", c->data[i]);
+	}
+
+	// Frames of subroutines sit below stack, locals above it
+	fprintf(file, "\tdata 0\n\tdata 0\n\tdata 0\n\tdata 0\nstack:\n");
+	for (int i = 0; i < 10; i++) {
+		fprintf(file, "\tdata 0\n");
+	}
+
+	return fclose(file) == 0;
+}
+
+// Runs argv with stdout to out (NULL: discarded) and stderr discarded; returns
+// the exit status, or -1 if the tool did not exit normally
+int spawn(char *const argv[], char const *out)
+{
+	pid_t pid = fork();
+	if (pid < 0) {
+		return -1;
+	}
+
+	if (pid == 0) {
+		alarm(SPAWN_TIMEOUT);
+
+		int fd = open(out != NULL ? out : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		int null_fd = open("/dev/null", O_WRONLY);
+		if (fd < 0 || null_fd < 0 || dup2(fd, STDOUT_FILENO) < 0 || dup2(null_fd, STDERR_FILENO) < 0) {
+			_exit(127);
+		}
+
+		execv(argv[0], argv);
+		_exit(127);
+	}
+
+	int status;
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Whole file, NUL-terminated; NULL if unreadable
+char *readFile(char const *path, size_t *len)
+{
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		return NULL;
+	}
+
+	char *data = NULL;
+	size_t cap = 0;
+	*len = 0;
+	while (true) {
+		if (cap - *len < 4096) {
+			cap = 2 * cap + 4096;
+			char *grown = realloc(data, cap + 1);
+			if (grown == NULL) {
+				free(data);
+				fclose(file);
+				return NULL;
+			}
+			data = grown;
+		}
+
+		size_t got = fread(data + *len, 1, cap - *len, file);
+		if (got == 0) {
+			break;
+		}
+		*len += got;
+	}
+
+	fclose(file);
+	data[*len] = 0;
+	return data;
+}
+
+// Runs '<option> <path>' on our emu server; returns its output (NULL on failure)
+char *serveRun(char const *opt, char const *path, int *status)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	strcpy(addr.sun_path, sock_path);
+	if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof (addr)) < 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return NULL;
+	}
+
+	char req[PATH_MAX + 64];
+	int len = snprintf(req, sizeof (req), "SIMPLE-EMU 1 %s -1 0 %d %s\n", opt, INT_MAX, path);
+	FILE *in = NULL;
+	if (write(fd, req, len) != len || shutdown(fd, SHUT_WR) != 0 || (in = fdopen(fd, "r")) == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	size_t err_len, out_len;
+	char *out = NULL;
+	if (fscanf(in, "%d %zu %zu", status, &err_len, &out_len) == 3 && getc(in) == '\n') {
+		// Sockets cannot seek, so the errors are read and dropped
+		char *err = malloc(err_len + 1);
+		out = malloc(out_len + 1);
+		if (err == NULL || out == NULL || fread(err, 1, err_len, in) != err_len || fread(out, 1, out_len, in) != out_len) {
+			free(out);
+			out = NULL;
+		} else {
+			out[out_len] = 0;
+		}
+		free(err);
+	}
+
+	fclose(in);
+	return out;
+}
+
+// (pc, sp, a, b) after each instruction before HALT
+typedef struct {
+	uint32_t	regs[4];
+} State;
+
+// Our trace: a, b, pc and sp after each instruction
+int parseTrace(char const *text, State **states)
+{
+	int n = 0, cap = 0;
+	*states = NULL;
+	int a, b, pc, sp;
+	int off;
+	while (sscanf(text, "a\t: %d\nb\t: %d\npc\t: %d\nsp\t: %d\n\n%n", &a, &b, &pc, &sp, &off) == 4) {
+		if (n == cap) {
+			cap = 2 * cap + 64;
+			*states = realloc(*states, cap * sizeof (State));
+		}
+		(*states)[n++] = (State) { { pc, sp, a, b } };
+		text += off;
+	}
+
+	return n;
+}
+
+// The sample's trace: registers before each instruction, so the first line
+// is skipped and the one for HALT ends it
+int parseSampleTrace(char const *text, State **states)
+{
+	int n = 0, cap = 0;
+	*states = NULL;
+	bool first = true;
+	for (char const *line = text; line != NULL && *line != 0; line = strchr(line, '\n'), line = (line != NULL ? line + 1 : NULL)) {
+		State st;
+		if (sscanf(line, "PC: %x\tSP: %x\tA: %x\tB: %x", &st.regs[0], &st.regs[1], &st.regs[2], &st.regs[3]) != 4) {
+			continue;
+		}
+
+		if (first) {
+			first = false;
+			continue;
+		}
+
+		if (n == cap) {
+			cap = 2 * cap + 64;
+			*states = realloc(*states, cap * sizeof (State));
+		}
+		(*states)[n++] = st;
+	}
+
+	return n;
+}
+
+// Words of a dump after marker: every hex number except each line's leading address
+int parseDump(char const *text, char const *marker, uint32_t **words)
+{
+	int n = 0, cap = 0;
+	*words = NULL;
+	char const *p = strstr(text, marker);
+	if (p == NULL) {
+		return -1;
+	}
+	p = strchr(p, '\n');
+
+	while (p != NULL && *p != 0) {
+		p++;
+		char *end;
+		strtoul(p, &end, 16);
+		if (end == p) {
+			p = strchr(p, '\n');
+			continue;
+		}
+
+		p = end + 1;
+		while (true) {
+			while (*p == ' ' || *p == '\t') {
+				p++;
+			}
+
+			// strtoul() would skip the newline into the next line's address
+			if (!isxdigit((unsigned char) *p)) {
+				break;
+			}
+
+			uint32_t word = strtoul(p, &end, 16);
+
+			if (n == cap) {
+				cap = 2 * cap + 64;
+				*words = realloc(*words, cap * sizeof (uint32_t));
+			}
+			(*words)[n++] = word;
+			p = end;
+		}
+
+		p = strchr(p, '\n');
+	}
+
+	return n;
+}
+
+// Object words; the sample tags data words with 0x13 in the low byte and the
+// value above it, which its emulator loads as the plain value
+int readObj(char const *path, bool sample, uint32_t **words)
+{
+	size_t len;
+	char *data = readFile(path, &len);
+	if (data == NULL || len % 4 != 0) {
+		free(data);
+		return -1;
+	}
+
+	*words = malloc(len + 4);
+	for (size_t i = 0; i < len / 4; i++) {
+		uint32_t word = (unsigned char) data[4 * i] | (unsigned char) data[4 * i + 1] << 8 | (unsigned char) data[4 * i + 2] << 16 | (uint32_t) (unsigned char) data[4 * i + 3] << 24;
+		if (sample && (word & 0xff) == 0x13) {
+			word = (uint32_t) ((int32_t) word >> 8);
+		}
+		(*words)[i] = word;
+	}
+
+	free(data);
+	return len / 4;
+}
+
+// Compares a case already assembled by our asm at dir/o/c<idx>.o; returns
+// a description of the first divergence, or NULL
+char const *compare(char const *dir, int idx, char *msg, int msg_size)
+{
+	char src[PATH_MAX], obj[PATH_MAX], sample_src[PATH_MAX], sample_obj[PATH_MAX], sample_log[PATH_MAX], sample_out[PATH_MAX];
+	snprintf(src, sizeof (src), "%s/o/c%d.asm", dir, idx);
+	snprintf(obj, sizeof (obj), "%s/o/c%d.o", dir, idx);
+	snprintf(sample_src, sizeof (sample_src), "%s/s/c%d.asm", dir, idx);
+	snprintf(sample_obj, sizeof (sample_obj), "%s/s/c%d.o", dir, idx);
+	snprintf(sample_log, sizeof (sample_log), "%s/s/c%d.log", dir, idx);
+	snprintf(sample_out, sizeof (sample_out), "%s/s/c%d.out", dir, idx);
+
+	char *sample_asm_argv[] = { (char *) sample_asm_path, sample_src, NULL };
+	size_t log_len = 0;
+	char *log = NULL;
+	if (spawn(sample_asm_argv, NULL) != 0 || (log = readFile(sample_log, &log_len)) == NULL || log_len != 0) {
+		free(log);
+		snprintf(msg, msg_size, "sample asm failed");
+		return msg;
+	}
+	free(log);
+
+	uint32_t *ours = NULL, *theirs = NULL;
+	int n = readObj(obj, false, &ours);
+	int sample_n = readObj(sample_obj, true, &theirs);
+	char const *ret = NULL;
+	if (n < 0) {
+		ret = "our asm failed";
+	} else if (sample_n != n) {
+		snprintf(msg, msg_size, "object sizes differ: %d words, sample %d", n, sample_n);
+		ret = msg;
+	} else {
+		for (int i = 0; i < n; i++) {
+			if (ours[i] != theirs[i]) {
+				snprintf(msg, msg_size, "object word 0x%08x differs: %08x, sample %08x", i, ours[i], theirs[i]);
+				ret = msg;
+				break;
+			}
+		}
+	}
+	free(ours);
+	free(theirs);
+	if (ret != NULL) {
+		return ret;
+	}
+
+	// The sample always prints its trace, so one run gives both
+	char *sample_emu_argv[] = { (char *) sample_emu_path, "-after", sample_obj, NULL };
+	size_t out_len;
+	char *sample_text = NULL;
+	if (spawn(sample_emu_argv, sample_out) != 0 || (sample_text = readFile(sample_out, &out_len)) == NULL) {
+		free(sample_text);
+		return "sample emu failed";
+	}
+
+	int status_trace, status_after;
+	char *trace = serveRun("-trace", obj, &status_trace);
+	char *after = serveRun("-after", obj, &status_after);
+	if (trace == NULL || after == NULL || status_trace != 0 || status_after != 0) {
+		ret = "our emu failed";
+	}
+
+	State *st = NULL, *sample_st = NULL;
+	uint32_t *mem = NULL, *sample_mem = NULL;
+	if (ret == NULL) {
+		int num = parseTrace(trace, &st);
+		int sample_num = parseSampleTrace(sample_text, &sample_st);
+		// The emulators reset sp differently; cases set it in their first two steps
+		for (int i = 1; i < num && i < sample_num && ret == NULL; i++) {
+			if (memcmp(&st[i], &sample_st[i], sizeof (State)) != 0) {
+				snprintf(
+					msg,
+					msg_size,
+					"trace differs after step %d: pc=%08x sp=%08x a=%08x b=%08x, sample pc=%08x sp=%08x a=%08x b=%08x",
+					i + 1,
+					st[i].regs[0], st[i].regs[1], st[i].regs[2], st[i].regs[3],
+					sample_st[i].regs[0], sample_st[i].regs[1], sample_st[i].regs[2], sample_st[i].regs[3]
+				);
+				ret = msg;
+			}
+		}
+
+		if (ret == NULL && num != sample_num) {
+			snprintf(msg, msg_size, "trace lengths differ: %d steps, sample %d", num, sample_num);
+			ret = msg;
+		}
+	}
+
+	if (ret == NULL) {
+		int num = parseDump(after, "(big endian)", &mem);
+		int sample_num = parseDump(sample_text, "Dumping from memory", &sample_mem);
+		if (num != sample_num) {
+			snprintf(msg, msg_size, "dump sizes differ: %d words, sample %d", num, sample_num);
+			ret = msg;
+		}
+
+		for (int i = 0; i < num && ret == NULL; i++) {
+			if (mem[i] != sample_mem[i]) {
+				snprintf(msg, msg_size, "word 0x%08x differs after the run: %08x, sample %08x", i, mem[i], sample_mem[i]);
+				ret = msg;
+			}
+		}
+	}
+
+	free(st);
+	free(sample_st);
+	free(mem);
+	free(sample_mem);
+	free(trace);
+	free(after);
+	free(sample_text);
+	return ret;
+}
+
+// Writes the case for both assemblers and runs ours on it alone
+char const *checkCase(Case const *c, char const *dir, char *msg, int msg_size)
+{
+	char src[PATH_MAX], sample_src[PATH_MAX];
+	snprintf(src, sizeof (src), "%s/o/c0.asm", dir);
+	snprintf(sample_src, sizeof (sample_src), "%s/s/c0.asm", dir);
+	if (!writeCase(c, src) || !writeCase(c, sample_src)) {
+		return "failed to write case";
+	}
+
+	char *asm_argv[] = { (char *) asm_path, "-no-lst", src, NULL };
+	spawn(asm_argv, NULL);
+	return compare(dir, 0, msg, msg_size);
+}
+
+// Removes items one at a time while the case still diverges, and keeps it in out_dir
+void minimize(Case *c, char const *dir, char const *why)
+{
+	char msg[256];
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (int i = 0; i < c->num_items; i++) {
+			if (c->removed[i]) {
+				continue;
+			}
+
+			c->removed[i] = true;
+			if (checkCase(c, dir, msg, sizeof (msg)) != NULL) {
+				changed = true;
+			} else {
+				c->removed[i] = false;
+			}
+		}
+	}
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof (path), "%s/diverged-%llu.asm", out_dir, (unsigned long long) c->seed);
+	writeCase(c, path);
+
+	pthread_mutex_lock(&lock);
+	fprintf(stderr, COL_RED "divergence: " COL_END "seed %llu: %s (minimized: %s)\n", (unsigned long long) c->seed, why, path);
+	num_diverged++;
+	pthread_mutex_unlock(&lock);
+}
+
+void *worker(void *arg)
+{
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof (dir), "%s/w%ld", out_dir, (long) (intptr_t) arg);
+
+	char sub[PATH_MAX];
+	mkdir(dir, 0755);
+	snprintf(sub, sizeof (sub), "%s/o", dir);
+	mkdir(sub, 0755);
+	snprintf(sub, sizeof (sub), "%s/s", dir);
+	mkdir(sub, 0755);
+
+	Case *batch = malloc(BATCH * sizeof (Case));
+	char paths[BATCH][PATH_MAX];
+	char *asm_argv[BATCH + 4];
+
+	while (true) {
+		pthread_mutex_lock(&lock);
+		long first = next_case;
+		next_case += BATCH;
+		pthread_mutex_unlock(&lock);
+
+		if (first >= num_cases) {
+			break;
+		}
+
+		int n = (num_cases - first < BATCH ? num_cases - first : BATCH);
+		asm_argv[0] = (char *) asm_path;
+		asm_argv[1] = "-no-lst";
+		for (int i = 0; i < n; i++) {
+			genCase(&batch[i], base_seed + first + i);
+
+			char sample_src[PATH_MAX];
+			snprintf(paths[i], PATH_MAX, "%s/o/c%d.asm", dir, i);
+			snprintf(sample_src, sizeof (sample_src), "%s/s/c%d.asm", dir, i);
+			writeCase(&batch[i], paths[i]);
+			writeCase(&batch[i], sample_src);
+			asm_argv[2 + i] = paths[i];
+		}
+		asm_argv[2 + n] = NULL;
+
+		// One spawn of our asm per batch; a failed file shows as a missing object
+		spawn(asm_argv, NULL);
+
+		for (int i = 0; i < n; i++) {
+			char msg[256];
+			char const *why = compare(dir, i, msg, sizeof (msg));
+			if (why != NULL) {
+				char saved[256];
+				snprintf(saved, sizeof (saved), "%s", why);
+				minimize(&batch[i], dir, saved);
+			}
+		}
+	}
+
+	free(batch);
+	return NULL;
+}
+
+// Starts our emu as a -serve server on sock_path; returns its pid
+pid_t startServer(int num_threads)
+{
+	char jobs[16];
+	snprintf(jobs, sizeof (jobs), "%d", num_threads);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		execl(emu_path, emu_path, "-j", jobs, "-serve", sock_path, (char *) NULL);
+		_exit(127);
+	}
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	strcpy(addr.sun_path, sock_path);
+	for (int i = 0; i < 500; i++) {
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		bool up = (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof (addr)) == 0);
+		if (fd >= 0) {
+			close(fd);
+		}
+		if (up) {
+			return pid;
+		}
+		usleep(10000);
+	}
+
+	kill(pid, SIGTERM);
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	base_seed = time(NULL);
+	out_dir = "fuzz-out";
+
+	bool ok = (argc >= 5);
+	for (int i = 5; ok && i < argc; i += 2) {
+		if (i + 1 == argc) {
+			ok = false;
+		} else if (strcmp(argv[i], "-n") == 0) {
+			num_cases = strtol(argv[i + 1], NULL, 0);
+		} else if (strcmp(argv[i], "-j") == 0) {
+			num_threads = strtol(argv[i + 1], NULL, 0);
+		} else if (strcmp(argv[i], "-seed") == 0) {
+			base_seed = strtoull(argv[i + 1], NULL, 0);
+		} else if (strcmp(argv[i], "-out") == 0) {
+			out_dir = argv[i + 1];
+		} else {
+			ok = false;
+		}
+	}
+
+	if (!ok || num_cases <= 0 || num_threads <= 0 || num_threads > 1024) {
+		fprintf(
+			stderr,
+			COL_RED "fatal error: " COL_END "incorrect usage\n"
+			"usage: %s <asm> <emu> <sample asm> <sample emu> [-n <cases>] [-j <threads>] [-seed <seed>] [-out <dir>]\n",
+			argv[0]
+		);
+		return EXIT_FAILURE;
+	}
+
+	// Tools are run from the workers' directories, so resolve them first
+	char *paths[4];
+	for (int i = 0; i < 4; i++) {
+		paths[i] = realpath(argv[1 + i], NULL);
+		if (paths[i] == NULL) {
+			fprintf(stderr, COL_RED "fatal error: " COL_END "failed to find '%s': %s\n", argv[1 + i], strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+	asm_path = paths[0];
+	emu_path = paths[1];
+	sample_asm_path = paths[2];
+	sample_emu_path = paths[3];
+
+	if (mkdir(out_dir, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "failed to create directory '%s': %s\n", out_dir, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	snprintf(sock_path, sizeof (sock_path), "%s/emu.sock", out_dir);
+	pid_t server = startServer(num_threads);
+	if (server < 0) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "failed to start '%s -serve'\n", emu_path);
+		return EXIT_FAILURE;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_t threads[num_threads];
+	for (long i = 0; i < num_threads; i++) {
+		pthread_create(&threads[i], NULL, worker, (void *) (intptr_t) i);
+	}
+	for (long i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	unlink(sock_path);
+
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("cases: %ld (seeds %llu..%llu), divergences: %d, %.0f cases/s\n", num_cases, (unsigned long long) base_seed, (unsigned long long) (base_seed + num_cases - 1), num_diverged, num_cases / secs);
+	return num_diverged == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
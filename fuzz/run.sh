@@ -0,0 +1,21 @@
+#!/bin/sh
+# Differential testing against the course sample assembler and emulator:
+# random programs are assembled and run by both, and any divergence in object
+# words, traces or final memory is minimized and kept in the work dir.
+# usage: fuzz/run.sh [<work dir>] [-n <cases>] [-j <threads>] [-seed <seed>]
+
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+out=${TMPDIR:-/tmp}/simple-fuzz
+case $1 in
+	-*|'') ;;
+	*) out=$1; shift ;;
+esac
+mkdir -p "$out"
+
+cc -std=c11 -O2 -pthread "$root/asm.c" -o "$out/asm"
+cc -std=c11 -O2 -pthread "$root/emu.c" -o "$out/emu"
+cc -std=c11 -O2 -pthread "$root/fuzz/fuzz.c" -o "$out/fuzz"
+
+exec "$out/fuzz" "$out/asm" "$out/emu" "$root/sample/asm" "$root/sample/emu" -out "$out/cases" "$@"
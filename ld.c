@@ -0,0 +1,395 @@
+/*****************************************************************
+*
+*  DECLARATION OF AUTHORSHIP
+*
+*  I hereby declare that this source file is my own unaided work.
+*
+*  Tejas Tanmay Singh
+*  2301AI30
+*
+*****************************************************************/
+
+// Links relocatable objects (.ro, produced by 'asm -r') into a single image.
+// The first object is placed at address 0, so execution starts at its first word.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// S_IRUSR, ...
+#include <sys/stat.h>
+
+#define COL_RED		"\033[1;31m"
+#define COL_WHITE	"\033[1;37m"
+#define COL_END		"\033[0m"
+
+#define RO_MAGIC	"SRO1"
+#define RO_HDR_SIZE	20
+#define RO_SYM_SIZE	16
+#define RO_RELOC_SIZE	12
+
+#define SYM_EXPORT	1
+#define SYM_IMPORT	2
+#define SYM_ABS		4
+
+#define RELOC_ABS	0
+#define RELOC_PCREL	1
+
+void *tryMalloc(size_t len)
+{
+	void *ret = malloc(len);
+	if (ret == NULL) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "malloc() failed: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	return ret;
+}
+
+typedef struct {
+	char const	*path;
+	unsigned char	*data;
+	int		len;
+
+	int		num_words;
+	int		num_syms;
+	int		num_relocs;
+	int		strtab_len;
+
+	unsigned char	*words;
+	unsigned char	*syms;
+	unsigned char	*relocs;
+	char const	*strtab;
+
+	// Word address of the object in the linked image
+	int		base;
+} Obj;
+
+// Little endian
+int getWord(unsigned char const *p)
+{
+	return (int) ((uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24);
+}
+
+void setWord(unsigned char *p, int word)
+{
+	p[0] = word & 0xff;
+	p[1] = (word >> 8) & 0xff;
+	p[2] = (word >> 16) & 0xff;
+	p[3] = (word >> 24) & 0xff;
+}
+
+bool readObj(Obj *obj)
+{
+	int fd = open(obj->path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "failed to open file '%s': %s\n", obj->path, strerror(errno));
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "failed to stat file '%s': %s\n", obj->path, strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	obj->len = st.st_size;
+	obj->data = tryMalloc(obj->len + 1);
+
+	int tot_read = 0;
+	while (tot_read < obj->len) {
+		ssize_t len = read(fd, obj->data + tot_read, obj->len - tot_read);
+		if (len <= 0) {
+			fprintf(stderr, COL_RED "fatal error: " COL_END "failed to read file '%s': %s\n", obj->path, len == 0 ? "unexpected end of file" : strerror(errno));
+			close(fd);
+			return false;
+		}
+
+		tot_read += len;
+	}
+
+	close(fd);
+
+	if (obj->len < RO_HDR_SIZE || memcmp(obj->data, RO_MAGIC, 4) != 0) {
+		fprintf(stderr, COL_RED "error: " COL_END "'%s' is not a relocatable object (assemble with -r)\n", obj->path);
+		return false;
+	}
+
+	obj->num_words = getWord(obj->data + 4);
+	obj->num_syms = getWord(obj->data + 8);
+	obj->num_relocs = getWord(obj->data + 12);
+	obj->strtab_len = getWord(obj->data + 16);
+
+	if (obj->num_words < 0 || obj->num_syms < 0 || obj->num_relocs < 0 || obj->strtab_len < 0
+			|| (int64_t) RO_HDR_SIZE + 4 * (int64_t) obj->num_words + RO_SYM_SIZE * (int64_t) obj->num_syms
+				+ RO_RELOC_SIZE * (int64_t) obj->num_relocs + obj->strtab_len != obj->len) {
+		fprintf(stderr, COL_RED "error: " COL_END "malformed object file '%s': inconsistent section sizes\n", obj->path);
+		return false;
+	}
+
+	obj->words = obj->data + RO_HDR_SIZE;
+	obj->syms = obj->words + 4 * obj->num_words;
+	obj->relocs = obj->syms + RO_SYM_SIZE * obj->num_syms;
+	obj->strtab = (char const *) (obj->relocs + RO_RELOC_SIZE * obj->num_relocs);
+
+	for (int i = 0; i < obj->num_syms; i++) {
+		unsigned char const *sym = obj->syms + RO_SYM_SIZE * i;
+		int name_off = getWord(sym);
+		int name_len = getWord(sym + 4);
+		if (name_off < 0 || name_len <= 0 || name_off > obj->strtab_len - name_len) {
+			fprintf(stderr, COL_RED "error: " COL_END "malformed object file '%s': bad name for symbol %d\n", obj->path, i);
+			return false;
+		}
+	}
+
+	for (int i = 0; i < obj->num_relocs; i++) {
+		unsigned char const *reloc = obj->relocs + RO_RELOC_SIZE * i;
+		int word_idx = getWord(reloc);
+		int sym = getWord(reloc + 4);
+		if (word_idx < 0 || word_idx >= obj->num_words || sym < -1 || sym >= obj->num_syms
+				|| sym >= 0 && !(getWord(obj->syms + RO_SYM_SIZE * sym + 12) & SYM_IMPORT)) {
+			fprintf(stderr, COL_RED "error: " COL_END "malformed object file '%s': bad relocation %d\n", obj->path, i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+typedef struct {
+	char const	*name;
+	int		name_len;
+	int		value;
+
+	// Defining object (index into objs)
+	int		obj;
+} Sym;
+
+// Open addressing hash table of exported symbols
+Sym	*syms;
+int	syms_cap;
+
+uint32_t hashName(char const *name, int len)
+{
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < len; i++) {
+		hash ^= (unsigned char) name[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+Sym *findSym(char const *name, int len)
+{
+	uint32_t i = hashName(name, len) & (syms_cap - 1);
+	while (syms[i].name != NULL && !(syms[i].name_len == len && memcmp(syms[i].name, name, len) == 0)) {
+		i = (i + 1) & (syms_cap - 1);
+	}
+
+	return &syms[i];
+}
+
+int writeAll(int fd, char const *data, int len)
+{
+	int written = 0;
+	int tot_written = 0;
+	while (tot_written < len && written >= 0) {
+		tot_written += written;
+		written = write(fd, data + tot_written, len - tot_written);
+	}
+
+	return tot_written;
+}
+
+// Operands are 24-bit signed
+bool fitsOp(int64_t val)
+{
+	return val >= -(1 << 23) && val < (1 << 23);
+}
+
+int main(int argc, char *argv[])
+{
+	char const *out_name = "a.o";
+
+	Obj *objs = tryMalloc(argc * sizeof (Obj));
+	int num_objs = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-o") == 0) {
+			if (i + 1 == argc) {
+				fprintf(stderr, COL_RED "fatal error: " COL_END "expected file name after '-o'\n");
+				return EXIT_FAILURE;
+			}
+
+			out_name = argv[++i];
+			continue;
+		}
+
+		objs[num_objs++] = (Obj) { .path = argv[i] };
+	}
+
+	if (num_objs == 0) {
+		fprintf(
+			stderr,
+			COL_RED "fatal error: " COL_END "no input files\n"
+			"usage: %s [-o <output>] <objects>\n",
+			argv[0]
+		);
+		return EXIT_FAILURE;
+	}
+
+	int64_t num_words = 0;
+	int num_exports = 0;
+	for (int i = 0; i < num_objs; i++) {
+		if (!readObj(&objs[i])) {
+			return EXIT_FAILURE;
+		}
+
+		objs[i].base = num_words;
+		num_words += objs[i].num_words;
+		num_exports += objs[i].num_syms;
+	}
+
+	if (!fitsOp(num_words)) {
+		fprintf(stderr, COL_RED "error: " COL_END "linked image too large (%lld words)\n", (long long) num_words);
+		return EXIT_FAILURE;
+	}
+
+	syms_cap = 16;
+	while (syms_cap < 2 * num_exports) {
+		syms_cap *= 2;
+	}
+	syms = calloc(syms_cap, sizeof (Sym));
+	if (syms == NULL) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "calloc() failed: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	bool err = false;
+
+	for (int i = 0; i < num_objs; i++) {
+		Obj const *obj = &objs[i];
+		for (int j = 0; j < obj->num_syms; j++) {
+			unsigned char const *ent = obj->syms + RO_SYM_SIZE * j;
+			int flags = getWord(ent + 12);
+			if (!(flags & SYM_EXPORT)) {
+				continue;
+			}
+
+			char const *name = obj->strtab + getWord(ent);
+			int name_len = getWord(ent + 4);
+
+			Sym *sym = findSym(name, name_len);
+			if (sym->name != NULL) {
+				fprintf(
+					stderr,
+					COL_WHITE "%s: " COL_RED "error: " COL_END "duplicate symbol (first defined in '%s')\n"
+					"	%.*s\n",
+					obj->path,
+					objs[sym->obj].path,
+					name_len,
+					name
+				);
+				err = true;
+				continue;
+			}
+
+			*sym = (Sym) {
+				.name = name,
+				.name_len = name_len,
+				.value = getWord(ent + 8) + (flags & SYM_ABS ? 0 : obj->base),
+				.obj = i,
+			};
+		}
+	}
+
+	unsigned char *out = tryMalloc(4 * num_words + 1);
+
+	for (int i = 0; i < num_objs; i++) {
+		Obj const *obj = &objs[i];
+		unsigned char *words = out + 4 * obj->base;
+		memcpy(words, obj->words, 4 * obj->num_words);
+
+		for (int j = 0; j < obj->num_relocs; j++) {
+			unsigned char const *reloc = obj->relocs + RO_RELOC_SIZE * j;
+			int word_idx = getWord(reloc);
+			int sym_idx = getWord(reloc + 4);
+			int kind = getWord(reloc + 8);
+
+			int word = getWord(words + 4 * word_idx);
+			int64_t op;
+
+			if (sym_idx < 0) {
+				// Local address
+				op = (int64_t) (word >> 8) + obj->base;
+			} else {
+				unsigned char const *ent = obj->syms + RO_SYM_SIZE * sym_idx;
+				char const *name = obj->strtab + getWord(ent);
+				int name_len = getWord(ent + 4);
+
+				Sym const *sym = findSym(name, name_len);
+				if (sym->name == NULL) {
+					fprintf(
+						stderr,
+						COL_WHITE "%s: " COL_RED "error: " COL_END "undefined symbol\n"
+						"	%.*s\n",
+						obj->path,
+						name_len,
+						name
+					);
+					err = true;
+					continue;
+				}
+
+				if (kind == RELOC_PCREL) {
+					op = (int64_t) sym->value - (obj->base + word_idx + 1);
+				} else {
+					op = sym->value;
+				}
+			}
+
+			if (!fitsOp(op)) {
+				fprintf(stderr, COL_WHITE "%s: " COL_RED "error: " COL_END "relocated operand out of range at word 0x%08x\n", obj->path, word_idx);
+				err = true;
+				continue;
+			}
+
+			setWord(words + 4 * word_idx, (word & 0xff) | (uint32_t) op << 8);
+		}
+	}
+
+	if (err) {
+		return EXIT_FAILURE;
+	}
+
+	int fd = creat(out_name, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "failed to create output file '%s': %s\n", out_name, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (writeAll(fd, (char const *) out, 4 * num_words) < 4 * num_words) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "failed to write to output file '%s': %s\n", out_name, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (close(fd) < 0) {
+		fprintf(stderr, COL_RED "fatal error: " COL_END "failed to close output file '%s': %s\n", out_name, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	for (int i = 0; i < num_objs; i++) {
+		free(objs[i].data);
+	}
+	free(objs);
+	free(syms);
+	free(out);
+	return EXIT_SUCCESS;
+}
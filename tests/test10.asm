@@ -0,0 +1,64 @@
+;****************************************************************
+;
+;  DECLARATION OF AUTHORSHIP
+;
+;  I hereby declare that this source file is my own unaided work.
+;
+;  Tejas Tanmay Singh
+;  2301AI30
+;
+;****************************************************************
+
+; Constant expressions, '.fill' and '.rept': sums the table below into res
+; (0x34), then stores end - tbl - total (0) at tbl + len + 1
+
+len: SET 4
+total: SET 2 * len + 2
+
+	ldc stack
+	a2sp
+	ldc 0
+	stl 0
+	ldc 0
+	stl 1
+loop:
+	ldl 1
+	ldc total
+	sub
+	brz done
+	ldl 1
+	ldc tbl
+	add
+	ldnl 0
+	ldl 0
+	add
+	stl 0
+	ldl 1
+	adc 1
+	stl 1
+	br loop
+done:
+	ldl 0
+	ldc res
+	stnl 0
+	ldc end - tbl - total
+	ldc ptr
+	ldnl 0
+	adc len - 1
+	stnl 1
+	HALT
+
+res:	data 0
+ptr:	data tbl + 1
+
+; len words of 7, len / 2 pairs of 1 and 2, then -6 and 24
+tbl:	.fill len, 7
+	.rept len / 2
+	data 1
+	data (2 - 1) * -2 + 4
+	.endr
+	data -(len - 1) * 2
+	data 010 + 0x10
+end:
+
+stack:	.fill 4, 0
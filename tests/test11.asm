@@ -0,0 +1,28 @@
+;****************************************************************
+;
+;  DECLARATION OF AUTHORSHIP
+;
+;  I hereby declare that this source file is my own unaided work.
+;
+;  Tejas Tanmay Singh
+;  2301AI30
+;
+;****************************************************************
+
+; Peephole optimizer (asm -O) next to a word addressed by number: sp is 0, so
+; 'ldl 6' reads word 6. The 'adc 0' before it stays, since deleting it would
+; move the data; the ones after the data go. Assemble with -O; a ends as 0x4e.
+
+	ldc 0
+	a2sp
+	adc 0
+	ldl 6
+	br rest
+	data 11
+	data 77
+
+rest:
+	adc 0
+	adc 1
+	adc 0
+	HALT
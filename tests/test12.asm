@@ -0,0 +1,45 @@
+;****************************************************************
+;
+;  DECLARATION OF AUTHORSHIP
+;
+;  I hereby declare that this source file is my own unaided work.
+;
+;  Tejas Tanmay Singh
+;  2301AI30
+;
+;****************************************************************
+
+; Profile-guided layout (asm -profile test12.prof): the loop is placed right
+; after the entry code, dropping 'br loop', and the cold code is moved behind
+; it. The loop count is a number but never an address, so nothing is pinned.
+; res ends as 0x5a.
+
+	ldc 0x1000
+	a2sp
+	ldc 10
+	stl 0
+	br loop
+
+	; Cold
+	ldc 0
+	HALT
+
+loop:
+	ldl 0
+	brz done
+	ldl 1
+	adc 9
+	stl 1
+	ldl 0
+	adc -1
+	stl 0
+	br loop
+
+done:
+	ldl 1
+	ldc res
+	stnl 0
+	HALT
+
+res:
+	data 0
@@ -0,0 +1,23 @@
+;****************************************************************
+;
+;  DECLARATION OF AUTHORSHIP
+;
+;  I hereby declare that this source file is my own unaided work.
+;
+;  Tejas Tanmay Singh
+;  2301AI30
+;
+;****************************************************************
+
+; Breakpoint on a word the program stores to (emu -debug test13.o < test13.dbg,
+; compared to test13.out): the program replaces 'ldc 1' at patch with 'ldc 7'
+; before running it. The breakpoint still stops there, 'x patch' shows the
+; stored word, and a ends as 7.
+
+	ldc 0x700
+	ldc patch
+	stnl 0
+
+patch:
+	ldc 1
+	HALT
@@ -0,0 +1,25 @@
+;****************************************************************
+;
+;  DECLARATION OF AUTHORSHIP
+;
+;  I hereby declare that this source file is my own unaided work.
+;
+;  Tejas Tanmay Singh
+;  2301AI30
+;
+;****************************************************************
+
+; Separate compilation: calls 'sum' from test7lib.asm
+; asm -r test7.asm test7lib.asm && simple-ld -o test7.o test7.ro test7lib.ro
+
+import sum
+import res
+import count
+
+	ldc 3
+	ldc count
+	stnl 0
+	call sum
+	ldc res
+	stnl 0
+	HALT
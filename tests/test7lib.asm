@@ -0,0 +1,39 @@
+;****************************************************************
+;
+;  DECLARATION OF AUTHORSHIP
+;
+;  I hereby declare that this source file is my own unaided work.
+;
+;  Tejas Tanmay Singh
+;  2301AI30
+;
+;****************************************************************
+
+; Library for test7.asm: sums 1..count into res
+; (return address in 'a', as left by 'call')
+
+export sum
+export res
+export count
+
+sum:	stl ret
+	ldc 0
+	stl acc
+loop:	ldl count
+	brz done
+	ldl acc
+	ldl count
+	add
+	stl acc
+	ldl count
+	adc -1
+	stl count
+	br loop
+done:	ldl acc
+	ldl ret
+	return
+
+count:	data 0
+res:	data 0
+acc:	data 0
+ret:	data 0
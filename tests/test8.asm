@@ -0,0 +1,54 @@
+;****************************************************************
+;
+;  DECLARATION OF AUTHORSHIP
+;
+;  I hereby declare that this source file is my own unaided work.
+;
+;  Tejas Tanmay Singh
+;  2301AI30
+;
+;****************************************************************
+
+; Demonstrates 'fadd', 'cas' and 'cid' (run with 'emu -cores 4 -after')
+; Each core counts its own 'count' word down to 0, adding 1 to 'total' with
+; 'fadd' and to 'locked' while holding a 'cas' spin lock on each step
+
+loop:
+	cid
+	ldnl count	; count[core id]
+	brz done
+	cid
+	ldnl count
+	adc -1
+	cid
+	stnl count
+
+	ldc 1
+	fadd total
+
+lock:
+	ldc 0		; Expected value
+	ldc 1		; New value
+	cas lockw
+	brz gotlock	; Old value was 0: the lock is ours
+	br lock
+
+gotlock:
+	ldl locked
+	adc 1
+	stl locked
+	ldc -1
+	fadd lockw	; Release
+	br loop
+
+done:
+	HALT
+
+total: data 0
+locked: data 0
+lockw: data 0
+count:
+	data 100
+	data 100
+	data 100
+	data 100
@@ -0,0 +1,51 @@
+;****************************************************************
+;
+;  DECLARATION OF AUTHORSHIP
+;
+;  I hereby declare that this source file is my own unaided work.
+;
+;  Tejas Tanmay Singh
+;  2301AI30
+;
+;****************************************************************
+
+; Demonstrates the console of 'emu -io': prints the sum of 1 to 10, then
+; copies stdin to stdout
+
+putc: SET 0x7fff00
+getc: SET 0x7fff01
+putd: SET 0x7fff02
+
+loop:
+	ldl n
+	brz print
+	ldl sum
+	ldl n
+	add
+	stl sum
+	ldl n
+	adc -1
+	stl n
+	br loop
+
+print:
+	ldl sum
+	ldc putd
+	stnl 0
+	ldc 10		; '\n'
+	ldc putc
+	stnl 0
+
+echo:
+	ldc getc
+	ldnl 0
+	brlz done	; End of input
+	ldc putc
+	stnl 0
+	br echo
+
+done:
+	HALT
+
+n: data 10
+sum: data 0